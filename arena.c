@@ -0,0 +1,48 @@
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "util.h"
+
+
+// see header file
+int init_arena(struct arena *a, size_t size) {
+    a->used = 0;
+
+    // explicit huge pages, if any are reserved
+    a->size = align(size, HUGE_PAGE_SIZE);
+    a->data = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (a->data != MAP_FAILED)
+        return TRUE;
+
+    // otherwise, regular pages, maybe merged into transparent huge pages
+    a->data = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (a->data == MAP_FAILED) {
+        a->data = NULL;
+        return FALSE;
+    }
+
+    madvise(a->data, a->size, MADV_HUGEPAGE);
+    madvise(a->data, a->size, MADV_WILLNEED);
+    memset(a->data, 0, a->size);
+    return TRUE;
+}
+
+void free_arena(struct arena *a) {
+    if (a->data != NULL)
+        munmap(a->data, a->size);
+    a->data = NULL;
+}
+
+void* arena_alloc(struct arena *a, size_t n) {
+    void *p;
+
+    n = align(n, CACHE_LINE_SIZE);
+    if (a->size - a->used < n)
+        return NULL;
+
+    p = a->data + a->used;
+    a->used += n;
+    return p;
+}
@@ -0,0 +1,49 @@
+/**
+ * Memory arenas. Each worker preallocates all of its handlers and buffer
+ * chunks in a single arena at startup, so serving requests never needs
+ * malloc(3) or free(3).
+ */
+
+#ifndef ARENA
+#define ARENA
+
+#include <stddef.h>
+
+#include "config.h"
+
+
+// macros
+
+#define align(n, a) (((n) + (a) - 1) & ~((size_t) (a) - 1))
+
+
+// data types
+
+struct arena {
+    char *data;
+    size_t size;
+    size_t used;
+};
+
+
+// functions
+
+/**
+ * Maps an arena of (at least) the given size, backed by huge pages if
+ * possible, and touches all of its pages up front. Returns FALSE if out of
+ * memory.
+ */
+int init_arena(struct arena*, size_t);
+
+/**
+ * Releases the arena and everything allocated from it.
+ */
+void free_arena(struct arena*);
+
+/**
+ * Allocates a cache line aligned block from the arena. Returns NULL if
+ * the arena is full. Blocks are never released on their own.
+ */
+void* arena_alloc(struct arena*, size_t);
+
+#endif
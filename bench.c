@@ -0,0 +1,736 @@
+/**
+ * HTTP load generator. Each thread drives its share of the connections
+ * with its own epoll instance, sending requests in one of three modes:
+ * keep-alive (one request at a time per connection), pipelining (batches
+ * of requests per connection) or close (a new connection per request).
+ * Requests are either built from the command line options or replayed
+ * from a file of raw HTTP requests, in order, round robin.
+ *
+ * The latency of every response is recorded in a log-linear histogram,
+ * as the server does (see metrics.h), and the totals are reported either
+ * as text or, with -j, as a single JSON object.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "util.h"
+
+// constants
+
+#define MODE_KEEP_ALIVE 0
+#define MODE_PIPELINE   1
+#define MODE_CLOSE      2
+#define MODE_COUNT      3
+
+#define MAX_REQUEST_COUNT 65536
+#define MAX_DEPTH       64
+#define INPUT_SIZE      65536
+#define MAX_EVENTS      256
+
+#define BENCH_BITS      4
+#define BENCH_MAX_EXP   40
+#define BENCH_BUCKETS   ((BENCH_MAX_EXP - BENCH_BITS + 1) << BENCH_BITS)
+
+static const char *mode_names[] = { "keep-alive", "pipeline", "close" };
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define QUANTILE_COUNT 4
+
+
+// data types
+
+/**
+ * A request to send, and whether its response has no body.
+ */
+struct request {
+    char *data;
+    int size;
+    int head;
+};
+
+struct histogram {
+    unsigned long counts[BENCH_BUCKETS];
+    unsigned long max;
+};
+
+/**
+ * Connection state. Requests are sent from _output_, and their send times
+ * are queued in _started_ until their responses arrive.
+ */
+struct connection {
+    int fd;
+    int connected;
+    int next;
+    char *output;
+    int output_size;
+    int sent;
+    int outstanding;
+    int first;
+    long started[MAX_DEPTH];
+    int head[MAX_DEPTH];
+    int closing;
+    char input[INPUT_SIZE];
+    int input_size;
+};
+
+struct totals {
+    unsigned long responses;
+    unsigned long non_2xx;
+    unsigned long errors;
+    unsigned long reconnects;
+    unsigned long sent;
+    unsigned long received;
+    struct histogram latency;
+};
+
+/**
+ * Per thread state.
+ */
+struct client {
+    pthread_t thread;
+    int epoll;
+    int count;
+    struct connection *connections;
+    struct totals totals;
+};
+
+
+// global state
+
+static struct addrinfo *address;
+static struct request requests[MAX_REQUEST_COUNT];
+static int request_count;
+static int mode;
+static int depth;
+static long end_time;
+
+
+// functions
+
+/**
+ * Gets the monotonic time, in nanoseconds.
+ */
+static long now_ns(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static int bucket_index(unsigned long v) {
+    int e;
+
+    if (v < (1 << BENCH_BITS))
+        return v;
+
+    e = 63 - __builtin_clzl(v);
+    if (e >= BENCH_MAX_EXP)
+        return BENCH_BUCKETS - 1;
+
+    return ((e - BENCH_BITS + 1) << BENCH_BITS)
+            + ((v >> (e - BENCH_BITS)) & ((1 << BENCH_BITS) - 1));
+}
+
+static double bucket_value(int i) {
+    unsigned long lower;
+    int shift;
+
+    if (i < (1 << BENCH_BITS))
+        return i;
+
+    shift = (i >> BENCH_BITS) - 1;
+    lower = (unsigned long) ((1 << BENCH_BITS)
+            + (i & ((1 << BENCH_BITS) - 1))) << shift;
+    return lower + (double) (1UL << shift) / 2;
+}
+
+/**
+ * Gets a quantile of a histogram, in nanoseconds.
+ */
+static double quantile(struct histogram *h, unsigned long total, double q) {
+    unsigned long c, rank;
+    int i;
+
+    if (total == 0)
+        return 0;
+
+    rank = (unsigned long) (q * (total - 1)) + 1;
+    for (c = 0, i = 0; i < BENCH_BUCKETS; i++) {
+        c += h->counts[i];
+        if (c >= rank)
+            return min(bucket_value(i), (double) h->max);
+    }
+    return h->max;
+}
+
+/**
+ * Adds a request to send, taking ownership of its data.
+ */
+static int add_request(char *data, int size) {
+    if (request_count == MAX_REQUEST_COUNT)
+        return FALSE;
+
+    requests[request_count].data = data;
+    requests[request_count].size = size;
+    requests[request_count].head = strncmp(data, "HEAD ", 5) == 0;
+    request_count++;
+    return TRUE;
+}
+
+/**
+ * Builds the request given on the command line.
+ */
+static int build_request(const char method[], const char path[],
+        int body) {
+    char *data;
+    int n;
+
+    data = (char*) malloc(strlen(method) + strlen(path) + body + 128);
+    if (data == NULL)
+        return FALSE;
+
+    n = sprintf(data, "%s %s HTTP/1.1\r\nHost: localhost\r\n%s",
+            method, path, (mode == MODE_CLOSE) ? "Connection: close\r\n" : "");
+    if (body > 0)
+        n += sprintf(data + n, "Content-Length: %d\r\n", body);
+    n += sprintf(data + n, "\r\n");
+    memset(data + n, 'x', body);
+    return add_request(data, n + body);
+}
+
+/**
+ * Gets the length of the request (or response) head at the start of
+ * _data_, and its Content-Length in _length_. Returns 0 if the head is
+ * incomplete.
+ */
+static int measure_message(const char *data, int size, int *length,
+        int *close) {
+    const char *end, *line;
+
+    end = memmem(data, size, "\r\n\r\n", 4);
+    if (end == NULL)
+        return 0;
+
+    *length = 0;
+    *close = FALSE;
+    for (line = data; line != NULL && line < end;) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+            *length = atoi(line + 15);
+        else if (strncasecmp(line, "Connection: close", 17) == 0)
+            *close = TRUE;
+
+        line = memchr(line, '\n', end - line);
+        if (line != NULL)
+            line++;
+    }
+    return end - data + 4;
+}
+
+/**
+ * Loads raw HTTP requests from a file, as written by the replay task of
+ * shovel.py: each request is a head, followed by as many body bytes as
+ * its Content-Length.
+ */
+static int load_requests(const char file[]) {
+    char *data, *request;
+    int close, head, length, n, p;
+    FILE *f;
+    long size;
+
+    f = fopen(file, "rb");
+    if (f == NULL)
+        return FALSE;
+
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (char*) malloc(size);
+    if (data == NULL || fread(data, 1, size, f) != size) {
+        fclose(f);
+        return FALSE;
+    }
+    fclose(f);
+
+    for (p = 0; p < size; p += n) {
+        head = measure_message(data + p, size - p, &length, &close);
+        n = head + length;
+        if (head == 0 || p + n > size)
+            break;
+
+        request = (char*) malloc(n);
+        if (request == NULL)
+            break;
+
+        memcpy(request, data + p, n);
+        if (!add_request(request, n))
+            break;
+    }
+
+    free(data);
+    return request_count > 0;
+}
+
+/**
+ * Opens a connection, without waiting for it to be established.
+ */
+static int open_connection(struct client *t, struct connection *c) {
+    struct epoll_event e;
+    int val;
+
+    c->fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK,
+            address->ai_protocol);
+    if (c->fd < 0)
+        return FALSE;
+
+    val = TRUE;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    if (connect(c->fd, address->ai_addr, address->ai_addrlen) != 0
+            && errno != EINPROGRESS) {
+        close(c->fd);
+        return FALSE;
+    }
+
+    c->connected = FALSE;
+    c->output_size = 0;
+    c->sent = 0;
+    c->outstanding = 0;
+    c->first = 0;
+    c->closing = FALSE;
+    c->input_size = 0;
+
+    e.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    e.data.ptr = c;
+    return epoll_ctl(t->epoll, EPOLL_CTL_ADD, c->fd, &e) == 0;
+}
+
+/**
+ * Closes a connection and opens a new one. Requests still waiting for a
+ * response are counted as errors unless the server announced the close.
+ */
+static void reopen_connection(struct client *t, struct connection *c) {
+    if (!c->closing)
+        t->totals.errors += c->outstanding;
+    if (mode != MODE_CLOSE)
+        t->totals.reconnects++;
+
+    close(c->fd);
+    if (!open_connection(t, c))
+        t->totals.errors++;
+}
+
+/**
+ * Queues as many requests as the mode allows, once the previous ones were
+ * answered.
+ */
+static void queue_requests(struct connection *c) {
+    struct request *r;
+    long t;
+    int i;
+
+    if (c->outstanding > 0 || c->closing)
+        return;
+
+    t = now_ns();
+    for (c->output_size = 0, c->sent = 0; c->outstanding < depth;) {
+        r = &(requests[c->next]);
+        memcpy(c->output + c->output_size, r->data, r->size);
+        c->output_size += r->size;
+
+        i = (c->first + c->outstanding) % MAX_DEPTH;
+        c->started[i] = t;
+        c->head[i] = r->head;
+        c->outstanding++;
+        c->next = (c->next + 1) % request_count;
+    }
+}
+
+/**
+ * Sends as much of the queued requests as the socket takes. Returns FALSE
+ * if the connection failed.
+ */
+static int send_requests(struct client *t, struct connection *c) {
+    int n;
+
+    while (c->sent < c->output_size) {
+        n = write(c->fd, c->output + c->sent, c->output_size - c->sent);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+
+        c->sent += n;
+        t->totals.sent += n;
+    }
+    return TRUE;
+}
+
+/**
+ * Records a response to the oldest outstanding request.
+ */
+static void record_response(struct client *t, struct connection *c,
+        int status, long now) {
+    struct histogram *h;
+    long latency;
+
+    latency = now - c->started[c->first];
+    c->first = (c->first + 1) % MAX_DEPTH;
+    c->outstanding--;
+
+    if (now > end_time)
+        return;
+
+    h = &(t->totals.latency);
+    h->counts[bucket_index(latency)]++;
+    h->max = max(h->max, (unsigned long) latency);
+    t->totals.responses++;
+    if (status != '2')
+        t->totals.non_2xx++;
+}
+
+/**
+ * Reads and records the responses received. Returns FALSE if the
+ * connection must be reopened.
+ */
+static int receive_responses(struct client *t, struct connection *c) {
+    int close, head, length, n, p;
+    long now;
+
+    for (;;) {
+        n = read(c->fd, c->input + c->input_size,
+                INPUT_SIZE - c->input_size);
+        if (n < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        else if (n == 0)
+            return FALSE;
+
+        t->totals.received += n;
+        c->input_size += n;
+        now = now_ns();
+
+        for (p = 0; c->outstanding > 0; p += head + length) {
+            head = measure_message(c->input + p, c->input_size - p,
+                    &length, &close);
+            if (c->head[c->first])
+                length = 0;
+            if (head == 0 || p + head + length > c->input_size)
+                break;
+
+            c->closing = c->closing || close;
+            record_response(t, c, (head > 9) ? c->input[p + 9] : 0, now);
+        }
+
+        c->input_size -= p;
+        memmove(c->input, c->input + p, c->input_size);
+        if (c->input_size == INPUT_SIZE) {
+            t->totals.errors++;
+            return FALSE;
+        }
+
+        if (c->outstanding == 0 && (c->closing || mode == MODE_CLOSE))
+            return FALSE;
+    }
+}
+
+/**
+ * Handles the events of a connection.
+ */
+static void serve_connection(struct client *t, struct connection *c,
+        int events) {
+    socklen_t length;
+    int err;
+
+    if (!c->connected) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+
+        length = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &length);
+        if (err != 0) {
+            t->totals.errors++;
+            reopen_connection(t, c);
+            return;
+        }
+        c->connected = TRUE;
+    }
+
+    if (!receive_responses(t, c)) {
+        reopen_connection(t, c);
+        return;
+    }
+
+    queue_requests(c);
+    if (!send_requests(t, c))
+        reopen_connection(t, c);
+}
+
+/**
+ * Client thread entry point. Runs until the end of the benchmark.
+ */
+static void* run_client(void *arg) {
+    struct epoll_event events[MAX_EVENTS];
+    struct connection *c;
+    struct client *t;
+    int i, n, size;
+
+    t = (struct client*) arg;
+    for (size = 0, i = 0; i < request_count; i++)
+        size = max(size, requests[i].size);
+
+    for (i = 0; i < t->count; i++) {
+        c = &(t->connections[i]);
+        c->next = i % request_count;
+        c->output = (char*) malloc(size * depth);
+        if (c->output == NULL || !open_connection(t, c))
+            t->totals.errors++;
+    }
+
+    while (now_ns() < end_time) {
+        n = epoll_wait(t->epoll, events, MAX_EVENTS, 100);
+        for (i = 0; i < n; i++)
+            serve_connection(t, (struct connection*) events[i].data.ptr,
+                    events[i].events);
+    }
+
+    for (i = 0; i < t->count; i++) {
+        close(t->connections[i].fd);
+        free(t->connections[i].output);
+    }
+    return NULL;
+}
+
+/**
+ * Adds up the totals of a client thread.
+ */
+static void add_totals(struct totals *dst, struct totals *src) {
+    int i;
+
+    dst->responses += src->responses;
+    dst->non_2xx += src->non_2xx;
+    dst->errors += src->errors;
+    dst->reconnects += src->reconnects;
+    dst->sent += src->sent;
+    dst->received += src->received;
+    for (i = 0; i < BENCH_BUCKETS; i++)
+        dst->latency.counts[i] += src->latency.counts[i];
+    dst->latency.max = max(dst->latency.max, src->latency.max);
+}
+
+/**
+ * Outputs the totals, as text or as a JSON object.
+ */
+static void report(struct totals *t, int connections, int duration,
+        const char label[], int json) {
+    double q[QUANTILE_COUNT], rate;
+    int i;
+
+    rate = (double) t->responses / duration;
+    for (i = 0; i < QUANTILE_COUNT; i++)
+        q[i] = quantile(&(t->latency), t->responses, quantiles[i]) / 1e3;
+
+    if (json) {
+        printf("{\"label\": \"%s\", \"mode\": \"%s\", \"connections\": %d, "
+                "\"depth\": %d, \"seconds\": %d, \"responses\": %lu, "
+                "\"non_2xx\": %lu, \"errors\": %lu, \"reconnects\": %lu, "
+                "\"requests_per_second\": %.0f, \"p50_us\": %.1f, "
+                "\"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+                "\"max_us\": %.1f}\n",
+                label, mode_names[mode], connections, depth, duration,
+                t->responses, t->non_2xx, t->errors, t->reconnects, rate,
+                q[0], q[1], q[2], q[3], t->latency.max / 1e3);
+        return;
+    }
+
+    printf("%s, %d connections, %d s: %lu responses (%lu non-2xx), "
+            "%lu errors, %lu reconnects\n", mode_names[mode], connections,
+            duration, t->responses, t->non_2xx, t->errors, t->reconnects);
+    printf("  %.0f requests/s, %.1f MB/s in, %.1f MB/s out\n", rate,
+            t->received / 1e6 / duration, t->sent / 1e6 / duration);
+    printf("  latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, "
+            "max %.1f\n", q[0], q[1], q[2], q[3], t->latency.max / 1e3);
+}
+
+/**
+ * Outputs the usage, with a line per option if asked for help.
+ */
+static void print_usage(FILE *out, const char name[], int help) {
+    fprintf(out, "usage: %s [-c connections] [-t threads] "
+            "[-d seconds] [-m keep-alive|pipeline|close] [-P depth] "
+            "[-X method] [-u path] [-b body size] [-f replay file] "
+            "[-l label] [-j] [-h] [host] [service]\n", name);
+    if (!help)
+        return;
+
+    fputs("\n"
+            "Sends requests to host (127.0.0.1) on service (8080) and reports\n"
+            "requests/s and latency percentiles.\n"
+            "\n"
+            "  -c, --connections N  open N connections (64)\n"
+            "  -t, --threads N      drive them from N threads (1)\n"
+            "  -d, --duration N     run for N seconds (5)\n"
+            "  -m, --mode MODE      keep-alive, pipeline, or close for a new\n"
+            "                       connection per request (keep-alive)\n"
+            "  -P, --depth N        requests per batch when pipelining (16)\n"
+            "  -X, --method METHOD  request method (GET)\n"
+            "  -u, --path PATH      request path (/)\n"
+            "  -b, --body N         send a body of N bytes (0)\n"
+            "  -f, --replay FILE    send the raw requests of a file instead,\n"
+            "                       in order (see shovel bench --replay)\n"
+            "  -l, --label LABEL    label of the run, in the JSON output\n"
+            "  -j, --json           report a single JSON object\n"
+            "  -h, --help           show this help\n", out);
+}
+
+
+// entry point
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "connections", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "duration", required_argument, NULL, 'd' },
+        { "mode", required_argument, NULL, 'm' },
+        { "depth", required_argument, NULL, 'P' },
+        { "method", required_argument, NULL, 'X' },
+        { "path", required_argument, NULL, 'u' },
+        { "body", required_argument, NULL, 'b' },
+        { "replay", required_argument, NULL, 'f' },
+        { "label", required_argument, NULL, 'l' },
+        { "json", no_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    struct addrinfo hints;
+    struct client *clients;
+    struct totals totals;
+    char *host, *label, *method, *path, *replay, *service;
+    int body, connections, duration, i, json, opt, threads, usage;
+
+    connections = 64;
+    threads = 1;
+    duration = 5;
+    mode = MODE_KEEP_ALIVE;
+    depth = 16;
+    method = "GET";
+    path = "/";
+    body = 0;
+    replay = NULL;
+    label = "";
+    json = FALSE;
+    usage = FALSE;
+    while ((opt = getopt_long(argc, argv, "c:t:d:m:P:X:u:b:f:l:jh", options,
+            NULL)) != -1) {
+        switch (opt) {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'm':
+            for (mode = 0; mode < MODE_COUNT; mode++)
+                if (strcmp(optarg, mode_names[mode]) == 0)
+                    break;
+            usage = usage || mode == MODE_COUNT;
+            break;
+        case 'P':
+            depth = atoi(optarg);
+            break;
+        case 'X':
+            method = optarg;
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        case 'b':
+            body = atoi(optarg);
+            break;
+        case 'f':
+            replay = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        case 'j':
+            json = TRUE;
+            break;
+        case 'h':
+            print_usage(stdout, argv[0], TRUE);
+            return 0;
+        default:
+            usage = TRUE;
+            break;
+        }
+    }
+
+    if (mode != MODE_PIPELINE)
+        depth = 1;
+
+    if (usage || mode == MODE_COUNT || connections < 1 || threads < 1 || duration < 1
+            || depth < 1 || depth > MAX_DEPTH || body < 0) {
+        print_usage(stderr, argv[0], FALSE);
+        return 1;
+    }
+
+    host = (optind < argc) ? argv[optind] : "127.0.0.1";
+    service = (optind + 1 < argc) ? argv[optind + 1] : "8080";
+    threads = min(threads, connections);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &address) != 0) {
+        fprintf(stderr, "Could not resolve %s:%s\n", host, service);
+        return 1;
+    }
+
+    if (replay != NULL ? !load_requests(replay)
+            : !build_request(method, path, body)) {
+        fprintf(stderr, "Could not load requests\n");
+        return 1;
+    }
+
+    // start client threads, with the connections split among them
+
+    clients = (struct client*) calloc(threads, sizeof(struct client));
+    if (clients == NULL)
+        return 1;
+
+    end_time = now_ns() + duration * 1000000000L;
+    for (i = 0; i < threads; i++) {
+        clients[i].count = connections / threads
+                + (i < connections % threads);
+        clients[i].connections = (struct connection*) calloc(
+                clients[i].count, sizeof(struct connection));
+        clients[i].epoll = epoll_create1(0);
+        if (clients[i].connections == NULL || clients[i].epoll < 0)
+            return 1;
+
+        pthread_create(&(clients[i].thread), NULL, run_client, &(clients[i]));
+    }
+
+    memset(&totals, 0, sizeof(totals));
+    for (i = 0; i < threads; i++) {
+        pthread_join(clients[i].thread, NULL);
+        add_totals(&totals, &(clients[i].totals));
+        close(clients[i].epoll);
+        free(clients[i].connections);
+    }
+
+    report(&totals, connections, duration, label, json);
+    free(clients);
+    freeaddrinfo(address);
+    return 0;
+}
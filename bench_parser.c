@@ -0,0 +1,98 @@
+/**
+ * Parser microbenchmark. Parses every request of the corpus (see
+ * harness.h) many times, fed whole and one byte at a time, and reports
+ * the time per request and the bytes parsed per cycle. Cycles are counted
+ * with the time stamp counter where there is one, which ticks at the
+ * nominal CPU frequency.
+ */
+
+#include <time.h>
+
+#include "harness.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0UL
+#endif
+
+
+// constants
+
+static const struct {
+    const char *name;
+    int step;
+} feeds[] = {
+    { "whole", 0 },
+    { "byte", 1 }
+};
+
+#define FEED_COUNT 2
+
+
+// functions
+
+/**
+ * Gets the monotonic time, in nanoseconds.
+ */
+static long now_ns(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/**
+ * Parses a corpus entry the given number of times, returning the time
+ * taken and setting the cycles taken and the requests parsed in each
+ * pass.
+ */
+static long run(const char data[], int step, int iterations,
+        unsigned long *c, int *requests) {
+    struct parse_result results[MAX_RESULTS];
+    unsigned long c0;
+    long t0;
+    int i, n;
+
+    n = strlen(data);
+    t0 = now_ns();
+    c0 = cycles();
+    for (i = 0; i < iterations; i++)
+        *requests = parse_stream(data, n, step, results, MAX_RESULTS);
+    *c = cycles() - c0;
+    return now_ns() - t0;
+}
+
+
+// entry point
+
+int main(int argc, char** argv) {
+    const struct corpus_entry *e;
+    unsigned long c;
+    double bpc;
+    int f, iterations, n, requests;
+    long t;
+
+    iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+    if (iterations < 1 || !init_harness()) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-10s %-6s %10s %12s %12s\n", "request", "feed", "bytes",
+            "ns/request", "bytes/cycle");
+    for (e = parser_corpus; e->name != NULL; e++) {
+        n = strlen(e->data);
+        for (f = 0; f < FEED_COUNT; f++) {
+            // warm up caches and branch predictors
+            run(e->data, feeds[f].step, iterations / 10 + 1, &c, &requests);
+
+            t = run(e->data, feeds[f].step, iterations, &c, &requests);
+            bpc = (c == 0) ? 0 : (double) n * iterations / c;
+            printf("%-10s %-6s %10d %12.1f %12.3f\n", e->name, feeds[f].name,
+                    n, (double) t / iterations / requests, bpc);
+        }
+    }
+    return 0;
+}
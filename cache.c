@@ -0,0 +1,251 @@
+#include <sys/mman.h>
+#include <time.h>
+
+#include "cache.h"
+
+// constants
+
+#define DEFAULT_BODY "hello world"
+
+#define SERVER_HEADER "Server: cserver\r\n"
+
+#define stringify(x) #x
+#define to_string(x) stringify(x)
+#define RETRY_AFTER_HEADER "Retry-After: " to_string(RETRY_AFTER) "\r\n"
+
+#define STATUS_LINE "HTTP/1.%d %s\r\n"
+#define RESPONSE_HEAD "%s%s%sContent-Length: %d\r\n\r\n"
+
+const int status_codes[] = { 200, 400, 500, 501, 503, 404, 206, 304, 416 };
+
+const char* status_lines[] = {
+    "200 OK",
+    "400 Bad Request",
+    "500 Internal Server Error",
+    "501 Not Implemented",
+    "503 Service Unavailable",
+    "404 Not Found",
+    "206 Partial Content",
+    "304 Not Modified",
+    "416 Range Not Satisfiable"
+};
+
+
+// global state
+
+struct cache response_cache;
+__thread char date_header[DATE_SIZE + 1];
+
+
+// functions
+
+/**
+ * Serializes a response, without the Date header, returning its size and
+ * the size of its status line in _split_. If _dst_ is NULL, only the
+ * sizes are computed.
+ */
+static int format_response(char *dst, struct cache_entry *e, int version,
+        int body, int keep_alive, int *split) {
+    const char *connection, *retry, *status;
+    int n;
+
+    connection = connection_header(version, keep_alive);
+    retry = (e->status == STATUS_503) ? RETRY_AFTER_HEADER : "";
+    status = status_lines[e->status];
+    if (dst == NULL) {
+        *split = snprintf(NULL, 0, STATUS_LINE, version, status);
+        n = *split + snprintf(NULL, 0, RESPONSE_HEAD,
+                response_cache.headers, retry, connection, e->body_size);
+    } else {
+        *split = sprintf(dst, STATUS_LINE, version, status);
+        n = *split + sprintf(dst + *split, RESPONSE_HEAD,
+                response_cache.headers, retry, connection, e->body_size);
+    }
+
+    if (body) {
+        if (dst != NULL)
+            memcpy(dst + n, e->body, e->body_size);
+        n += e->body_size;
+    }
+    return n;
+}
+
+/**
+ * Serializes every response of an entry to _dst_, returning the number
+ * of bytes used. If _dst_ is NULL, only the size is computed.
+ */
+static int format_entry(char *dst, struct cache_entry *e) {
+    struct cached_response *r;
+    int b, k, n, v;
+
+    n = 0;
+    for (v = 0; v < VERSION_COUNT; v++) {
+        for (b = 0; b < 2; b++) {
+            for (k = 0; k < 2; k++) {
+                r = &(e->responses[v][b][k]);
+                r->size = format_response(
+                        (dst == NULL) ? NULL : dst + n, e, v, b, k,
+                        &(r->split));
+                r->data = (dst == NULL) ? NULL : dst + n;
+                r->status = e->status;
+                n += r->size;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * Serializes every cached response to _dst_, returning the total size.
+ * If _dst_ is NULL, only the size is computed.
+ */
+static int format_cache(char *dst) {
+    struct cache *c;
+    int i, n;
+
+    c = &response_cache;
+    n = 0;
+    for (i = 0; i < STATUS_COUNT; i++)
+        n += format_entry((dst == NULL) ? NULL : dst + n, &(c->entries[i]));
+
+    for (i = 0; i < c->route_count; i++)
+        n += format_entry((dst == NULL) ? NULL : dst + n,
+                &(c->routes[i].entry));
+    return n;
+}
+
+/**
+ * Finds the route matching the request path, optionally only among health
+ * checks, and gets its cached response. Returns NULL if there is none.
+ */
+static const struct cached_response* find_route(struct parser *p,
+        int body, int keep_alive, int health) {
+    struct route *r;
+    int i;
+
+    for (i = 0; i < response_cache.route_count; i++) {
+        r = &(response_cache.routes[i]);
+        if (health && !r->health)
+            continue;
+
+        if (slice_equals(p, &(p->request.path), r->path, r->length))
+            return &(r->entry.responses[p->request.version - '0']
+                    [body != 0][keep_alive != 0]);
+    }
+    return NULL;
+}
+
+
+// see header file
+int add_route(const char path[], const char body[]) {
+    struct route *r;
+
+    if (response_cache.route_count == MAX_ROUTES)
+        return FALSE;
+
+    r = &(response_cache.routes[response_cache.route_count++]);
+    r->path = path;
+    r->length = strlen(path);
+    r->health = FALSE;
+    r->entry.status = STATUS_200;
+    r->entry.body = body;
+    r->entry.body_size = strlen(body);
+    return TRUE;
+}
+
+int add_health_check(const char path[]) {
+    if (!add_route(path, "ok"))
+        return FALSE;
+
+    response_cache.routes[response_cache.route_count - 1].health = TRUE;
+    return TRUE;
+}
+
+int add_header(const char line[]) {
+    if (response_cache.header_count == MAX_EXTRA_HEADERS)
+        return FALSE;
+
+    if (strchr(line, ':') == NULL || strpbrk(line, "\r\n") != NULL)
+        return FALSE;
+
+    response_cache.extra_headers[response_cache.header_count++] = line;
+    return TRUE;
+}
+
+int init_cache(void) {
+    struct cache *c;
+    int i, n;
+
+    c = &response_cache;
+
+    // fixed headers, sent after the Date header
+
+    n = strlen(SERVER_HEADER);
+    for (i = 0; i < c->header_count; i++)
+        n += strlen(c->extra_headers[i]) + 2;
+
+    c->headers = (char*) malloc(n + 1);
+    if (c->headers == NULL)
+        return FALSE;
+
+    strcpy(c->headers, SERVER_HEADER);
+    for (i = 0; i < c->header_count; i++) {
+        strcat(c->headers, c->extra_headers[i]);
+        strcat(c->headers, "\r\n");
+    }
+
+    for (i = 0; i < STATUS_COUNT; i++) {
+        c->entries[i].status = i;
+        c->entries[i].body = (i == STATUS_200) ? DEFAULT_BODY : "";
+        c->entries[i].body_size = strlen(c->entries[i].body);
+    }
+
+    // one extra byte for the null terminator written by sprintf
+    c->size = format_cache(NULL) + 1;
+    c->data = mmap(NULL, c->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c->data == MAP_FAILED)
+        return FALSE;
+
+    format_cache(c->data);
+    return TRUE;
+}
+
+void seal_cache(void) {
+    mprotect(response_cache.data, response_cache.size, PROT_READ);
+}
+
+const char* connection_header(int version, int keep_alive) {
+    if (keep_alive && version == 0)
+        return "Connection: keep-alive\r\n";
+    else if (!keep_alive && version != 0)
+        return "Connection: close\r\n";
+    else
+        return "";
+}
+
+void update_date(void) {
+    struct tm t;
+    time_t now;
+
+    now = time(NULL);
+    gmtime_r(&now, &t);
+    strftime(date_header, sizeof(date_header),
+            "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &t);
+}
+
+const struct cached_response* get_response(int status, char version,
+        int body, int keep_alive) {
+    return &(response_cache.entries[status]
+            .responses[version - '0'][body != 0][keep_alive != 0]);
+}
+
+const struct cached_response* get_route(struct parser *p, int body,
+        int keep_alive) {
+    return find_route(p, body, keep_alive, FALSE);
+}
+
+const struct cached_response* get_health_check(struct parser *p, int body,
+        int keep_alive) {
+    return find_route(p, body, keep_alive, TRUE);
+}
@@ -0,0 +1,158 @@
+/**
+ * Static response cache. Every response that depends only on the HTTP
+ * version, the status, the method and the connection options is
+ * serialized once at startup, so serving it takes just a pointer and a
+ * length. Routes with static bodies and extra headers can be added
+ * before the cache is built.
+ *
+ * The Date header is the only part that changes: each worker keeps its
+ * own copy, refreshed once per second, which is sent between the status
+ * line and the rest of the cached response.
+ */
+
+#ifndef CACHE
+#define CACHE
+
+#include "config.h"
+#include "parser.h"
+
+
+// constants
+
+#define STATUS_200      0
+#define STATUS_400      1
+#define STATUS_500      2
+#define STATUS_501      3
+#define STATUS_503      4
+#define STATUS_404      5
+#define STATUS_206      6
+#define STATUS_304      7
+#define STATUS_416      8
+#define STATUS_COUNT    9
+
+#define VERSION_COUNT   10
+
+// "Date: " + IMF-fixdate + CRLF
+#define DATE_SIZE       37
+
+
+// data types
+
+/**
+ * A serialized response. The Date header goes after the first _split_
+ * bytes, which hold the status line. _status_ is one of STATUS_*.
+ */
+struct cached_response {
+    const char *data;
+    int size;
+    int split;
+    int status;
+};
+
+/**
+ * Responses for a given status (or route), by HTTP minor version, by
+ * whether the body is sent (not for HEAD) and by connection persistence.
+ */
+struct cache_entry {
+    const char *body;
+    int body_size;
+    int status;
+    struct cached_response responses[VERSION_COUNT][2][2];
+};
+
+struct route {
+    const char *path;
+    int length;
+    int health;
+    struct cache_entry entry;
+};
+
+struct cache {
+    char *data;
+    int size;
+    char *headers;
+    int header_count;
+    const char *extra_headers[MAX_EXTRA_HEADERS];
+    int route_count;
+    struct route routes[MAX_ROUTES];
+    struct cache_entry entries[STATUS_COUNT];
+};
+
+
+// global state
+
+extern struct cache response_cache;
+
+/**
+ * The status codes of STATUS_*.
+ */
+extern const int status_codes[];
+
+/**
+ * The Date header line of the current worker.
+ */
+extern __thread char date_header[DATE_SIZE + 1];
+
+
+// functions
+
+/**
+ * Adds a route with a static body, served with status 200 for GET and
+ * HEAD requests to the given path. Must be called before init_cache.
+ * Returns FALSE if there are too many routes.
+ */
+int add_route(const char path[], const char body[]);
+
+/**
+ * Adds a health check route, answered with "ok" even when the server is
+ * overloaded. Must be called before init_cache. Returns FALSE if there
+ * are too many routes.
+ */
+int add_health_check(const char path[]);
+
+/**
+ * Adds a header line, like "Name: value", to every response. Must be
+ * called before init_cache. Returns FALSE if the line is invalid or if
+ * there are too many headers.
+ */
+int add_header(const char line[]);
+
+/**
+ * Builds every cached response. Returns FALSE if out of memory.
+ */
+int init_cache(void);
+
+/**
+ * Makes the cached responses read-only, once set up.
+ */
+void seal_cache(void);
+
+/**
+ * Gets the Connection header line needed for the given HTTP minor version
+ * and connection persistence, which may be empty.
+ */
+const char* connection_header(int, int);
+
+/**
+ * Refreshes the Date header of the current worker.
+ */
+void update_date(void);
+
+/**
+ * Gets the cached response for the given status.
+ */
+const struct cached_response* get_response(int, char, int, int);
+
+/**
+ * Gets the cached response for the route matching the request path, or
+ * NULL if there is none.
+ */
+const struct cached_response* get_route(struct parser*, int, int);
+
+/**
+ * Gets the cached response for the health check route matching the
+ * request path, or NULL if there is none.
+ */
+const struct cached_response* get_health_check(struct parser*, int, int);
+
+#endif
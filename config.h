@@ -5,10 +5,48 @@
 #define CONFIG
 
 #define BACKLOG_SIZE    1000
+#define ACCEPT_BATCH    64
 #define BUFFER_SIZE     4096
+#define REQUEST_INLINE_SIZE 1024
+#define RESPONSE_INLINE_SIZE 256
 #define MAX_BUFFERS     4096
 #define MAX_HANDLERS    1000
+#define RESERVED_HANDLERS 8
+#define RETRY_AFTER     1
+#define MAX_REQUESTS    100
+#define MAX_PIPELINE    16
+#define MAX_HEADERS     32
+#define MAX_REQUEST_HEAD 65536
+#define MAX_RESPONSE_PARTS 64
+#define MAX_ROUTES      16
+#define MAX_EXTRA_HEADERS 16
+#define METRICS_PATH    "/__metrics"
+#define METRICS_SIZE    8192
+#define HISTOGRAM_BITS  4
+#define HISTOGRAM_MAX_EXP 40
+#define FILE_CACHE_SIZE 256
+#define FILE_CACHE_BUCKETS 512
+#define FILE_PATH_SIZE  1024
+#define LOG_RING_SIZE   4096
+#define LOG_PATH_SIZE   64
+#define LOG_BUFFER_SIZE 65536
+#define LOG_FLUSH_INTERVAL 100
+#define LOG_ERROR_RATE  10
+#define DEFER_ACCEPT_TIMEOUT 5
+#define IDLE_TIMEOUT    5
+#define HEADER_TIMEOUT  10
+#define BODY_TIMEOUT    10
+#define WRITE_TIMEOUT   10
+#define TIMER_SLOTS     64
+#define MAX_WORKERS     256
+#define CACHE_LINE_SIZE 64
+#define HUGE_PAGE_SIZE  (2 << 20)
 #define DEFAULT_SERVICE "8080"
 
+// io_uring backend
+
+#define URING_ENTRIES   4096
+#define URING_BUFFERS   1024
+
 #endif
 
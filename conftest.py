@@ -1,27 +1,81 @@
+import ctypes
+import os
 import pytest
 
 from pathlib import Path
 from signal import SIGINT
+from socket import create_connection
 from subprocess import check_call, Popen, TimeoutExpired
+from time import sleep
 
 
-@pytest.fixture(scope='session')
-def server(request):
-    src = Path('server.c')
-    exe = Path('/tmp/cserver')
-    check_call(('gcc', '-o', str(exe), str(src), '-lev'))
-    proc = Popen([str(exe)])
+# the sources and flags of each I/O backend, all tested alike
+BACKENDS = {
+    'libev': ((), ()),
+    'uring': (('uring.c',), ('-D', 'URING')),
+}
 
-    def cleanup():
+def uring_supported():
+    '''Checks that io_uring_setup(2) works, as it may be disabled.'''
+    params = ctypes.create_string_buffer(120)
+    fd = ctypes.CDLL(None, use_errno=True).syscall(425, 1, params)
+    if fd < 0:
+        return False
+    os.close(fd)
+    return True
+
+@pytest.fixture(scope='session', params=sorted(BACKENDS))
+def executable(request):
+    if request.param == 'uring' and not uring_supported():
+        pytest.skip('io_uring is not available')
+
+    src = ('arena.c', 'errors.c', 'util.c', 'scan.c', 'parser.c', 'cache.c',
+           'files.c', 'log.c', 'metrics.c', 'server.c', 'timer.c')
+    extra, flags = BACKENDS[request.param]
+    exe = Path('/tmp/cserver-' + request.param)
+    check_call(['gcc', '-o', str(exe)] + list(flags)
+               + [str(Path(f)) for f in src + extra] + ['-lev', '-pthread'])
+    request.addfinalizer(exe.unlink)
+    return exe
+
+def start_server(exe, args, port):
+    proc = Popen([str(exe)] + args + [str(port)])
+
+    # wait for the server to listen
+    for _ in range(50):
         try:
-            proc.send_signal(SIGINT)
-            proc.wait(5)
-        except TimeoutExpired:
-            proc.terminate()
-            proc.wait()
-        finally:
-            exe.unlink()
-    request.addfinalizer(cleanup)
+            create_connection(('127.0.0.1', port)).close()
+            break
+        except ConnectionRefusedError:
+            sleep(0.1)
+    return proc
 
+def stop_server(proc):
+    try:
+        proc.send_signal(SIGINT)
+        proc.wait(5)
+    except TimeoutExpired:
+        proc.terminate()
+        proc.wait()
+
+@pytest.fixture(scope='session')
+def server(request, executable):
+    proc = start_server(executable, ['-r', '/health=ok', '-H', 'X-Test: yes'], 8080)
+    request.addfinalizer(lambda: stop_server(proc))
     return '127.0.0.1:8080'
 
+@pytest.fixture
+def custom_server(request, executable):
+    '''Starts a server with the given arguments, on a port of its own.'''
+    procs = []
+
+    def start(*args):
+        port = 8081 + len(procs)
+        procs.append(start_server(executable, list(args), port))
+        return '127.0.0.1:%d' % port
+
+    def cleanup():
+        for proc in procs:
+            stop_server(proc)
+    request.addfinalizer(cleanup)
+    return start
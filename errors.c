@@ -1,64 +1,102 @@
-#include "errors.h"
+#include <string.h>
 
-void error(int err, int code) {
-    fputs("ERROR ", stderr);
+#include "errors.h"
 
+/**
+ * Gets the message of an error, without its details.
+ */
+static const char* error_message(int err, int code) {
     switch (err) {
     case E_ADDRINFO:
-        fputs(gai_strerror(code), stderr);
-        break;
+        return gai_strerror(code);
+    case E_SOCKET:
+        return "Failed to open server socket";
+    case E_BIND:
+        return "Failed to bind server socket";
+    case E_LISTEN:
+        return "Failed to listen on server socket";
+    case E_MEMORY:
+        return "Out of memory";
+    case E_READ:
+        return "Could not read socket";
+    case E_PARSE:
+        return "Could not parse request";
+    case E_WRITE:
+        return "Could not write response";
+    case E_URING:
+        return "Failed to set up io_uring";
+    default:
+        return NULL;
+    }
+}
 
+/**
+ * Gets the details of an error given by its code, which may be empty.
+ * Those of system calls on connections are formatted into the given
+ * buffer.
+ */
+static const char* error_detail(int err, int code, char buffer[],
+        int size) {
+    switch (err) {
     case E_SOCKET:
-        fputs("Failed to open server socket", stderr);
-        switch (code) {
-        case EACCES:
-            fputs(": access denied", stderr);
-            break;
-        case ENOBUFS:
-        case ENOMEM:
-            fputs(": out of memory", stderr);
-            break;
-        }
+        if (code == EACCES)
+            return ": access denied";
+        else if (code == ENOBUFS || code == ENOMEM)
+            return ": out of memory";
         break;
 
     case E_BIND:
-        fputs("Failed to bind server socket", stderr);
-        switch (code) {
-        case EACCES:
-            fputs(": access denied", stderr);
-            break;
-        case EADDRINUSE:
-            fputs(": address already in use", stderr);
-            break;
-        }
+        if (code == EACCES)
+            return ": access denied";
+        else if (code == EADDRINUSE)
+            return ": address already in use";
         break;
 
     case E_LISTEN:
-        fputs("Failed to listen on server socket", stderr);
         if (code == EADDRINUSE)
-            fputs(": address already in use", stderr);
-        break;
-
-    case E_MEMORY:
-        fputs("Out of memory", stderr);
+            return ": address already in use";
         break;
 
     case E_READ:
-        fputs("Could not read socket", stderr);
-        break;
-
-    case E_PARSE:
-        fputs("Could not parse request", stderr);
-        break;
-
     case E_WRITE:
-        fputs("Could not write response", stderr);
+        // the errno of the failed call, if any
+        if (code != 0 && strerror_r(code, buffer + 2, size - 2) == 0) {
+            buffer[0] = ':';
+            buffer[1] = ' ';
+            return buffer;
+        }
         break;
 
-    default:
-        fprintf(stderr, "Unknown error: %d", err);
+    case E_URING:
+        if (code == ENOMEM)
+            return ": out of locked memory";
+        else if (code == ENOSYS)
+            return ": not supported by the kernel";
+        else if (code == EPERM)
+            return ": disabled by the system";
         break;
     }
-    fputc('\n', stderr);
+    return "";
+}
+
+int format_error(char dst[], int size, int err, int code) {
+    char detail[ERROR_SIZE];
+    const char *message;
+
+    message = error_message(err, code);
+    if (message == NULL)
+        return snprintf(dst, size, "ERROR Unknown error: %d", err);
+
+    return snprintf(dst, size, "ERROR %s%s", message,
+            error_detail(err, code, detail, ERROR_SIZE));
 }
 
+void error(int err, int code) {
+    char line[ERROR_SIZE];
+    int n;
+
+    n = format_error(line, ERROR_SIZE - 1, err, code);
+    n = (n < ERROR_SIZE - 1) ? n : ERROR_SIZE - 2;
+    line[n++] = '\n';
+    fwrite(line, 1, n, stderr);
+}
@@ -26,9 +26,25 @@
 #define E_PARSE     7
 #define E_WRITE     8
 
+// backend errors
+
+#define E_URING     9
+
+#define E_COUNT     10
+
+// longest error message line
+#define ERROR_SIZE  128
+
+
+/**
+ * Formats the message of an error, without a trailing newline, like
+ * snprintf(3).
+ */
+int format_error(char[], int, int, int);
 
 /**
- * Outputs a corresponding error message to stderr.
+ * Outputs a corresponding error message to stderr, synchronously. Worker
+ * threads should log errors with log_error instead.
  */
 void error(int cat, int code);
 
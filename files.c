@@ -0,0 +1,479 @@
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "files.h"
+
+// constants
+
+#define INDEX_FILE  "index.html"
+
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE \
+        | IN_MOVE_SELF | IN_DELETE_SELF)
+
+// the headers of a file, after the fixed headers, in three parts
+#define VALIDATOR_HEADERS "ETag: %s\r\nLast-Modified: %s\r\n"
+#define TYPE_HEADERS "Content-Type: %s\r\nAccept-Ranges: bytes\r\n"
+#define LENGTH_HEADER "Content-Length: %ld\r\n"
+
+static const char *content_types[][2] = {
+    { ".html", "text/html; charset=utf-8" },
+    { ".htm", "text/html; charset=utf-8" },
+    { ".css", "text/css; charset=utf-8" },
+    { ".js", "text/javascript; charset=utf-8" },
+    { ".json", "application/json" },
+    { ".txt", "text/plain; charset=utf-8" },
+    { ".xml", "application/xml" },
+    { ".svg", "image/svg+xml" },
+    { ".png", "image/png" },
+    { ".jpg", "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".gif", "image/gif" },
+    { ".webp", "image/webp" },
+    { ".ico", "image/x-icon" },
+    { ".wasm", "application/wasm" },
+    { ".pdf", "application/pdf" },
+    { NULL, "application/octet-stream" }
+};
+
+
+// global state
+
+static char *root_path;
+static int root_fd = -1;
+
+
+// functions
+
+/**
+ * Gets the hash table bucket of a path.
+ */
+static int bucket_index(const char path[]) {
+    unsigned long h;
+
+    for (h = 14695981039346656037UL; *path != '\0'; path++)
+        h = (h ^ (unsigned char) *path) * 1099511628211UL;
+    return h % FILE_CACHE_BUCKETS;
+}
+
+/**
+ * Copies the request path, checking that it stays under the document
+ * root. Returns FALSE if it is invalid or too long.
+ */
+static int copy_path(struct parser *p, char dst[]) {
+    struct slice *path;
+    char *s;
+    int i, k;
+
+    path = &(p->request.path);
+    if (path->length == 0 || path->length + sizeof(INDEX_FILE)
+            > FILE_PATH_SIZE)
+        return FALSE;
+
+    for (i = 0; i < path->length; i += k) {
+        s = buffer_span(&(p->buffer), path->offset + i, &k);
+        k = min(k, path->length - i);
+        memcpy(dst + i, s, k);
+    }
+    dst[i] = '\0';
+
+    if (dst[0] != '/' || strstr(dst, "/../") != NULL
+            || strcmp(dst + i - min(i, 3), "/..") == 0)
+        return FALSE;
+
+    if (dst[i - 1] == '/')
+        strcpy(dst + i, INDEX_FILE);
+    return TRUE;
+}
+
+static const char* content_type(const char path[]) {
+    const char *extension;
+    int i;
+
+    extension = strrchr(path, '.');
+    for (i = 0; content_types[i][0] != NULL; i++)
+        if (extension != NULL
+                && strcasecmp(extension, content_types[i][0]) == 0)
+            break;
+    return content_types[i][1];
+}
+
+/**
+ * Builds the validators and headers of a file, after the fixed headers of
+ * every response: ETag and Last-Modified, which end the headers of a 304,
+ * Content-Type and Accept-Ranges, which end those of a 206, and
+ * Content-Length. They always fit, the longest content type included.
+ */
+static void build_headers(struct file_entry *f) {
+    const char *type;
+    struct tm t;
+    int n;
+
+    gmtime_r(&(f->mtime), &t);
+    strftime(f->modified, HTTP_DATE_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &t);
+    snprintf(f->etag, ETAG_SIZE, "\"%lx-%lx\"", (long) f->mtime, f->size);
+    type = content_type(f->path);
+
+    n = sprintf(f->headers, VALIDATOR_HEADERS, f->etag, f->modified);
+    f->not_modified_size = n;
+    n += sprintf(f->headers + n, TYPE_HEADERS, type);
+    f->partial_size = n;
+    n += sprintf(f->headers + n, LENGTH_HEADER, f->size);
+    f->headers_size = n;
+}
+
+/**
+ * Checks if a list of entity tags, as in If-None-Match, has the ETag of a
+ * file, or is "*". Weak tags match too.
+ */
+static int match_etag(struct file_entry *f, struct parser *p,
+        struct slice *s) {
+    struct buffer *b;
+    char c;
+    int i, n;
+
+    b = &(p->buffer);
+    n = strlen(f->etag);
+    for (i = 0; i < s->length; i++) {
+        c = buffer_get(b, s->offset + i);
+        if (c == ',' || c == ' ' || c == '\t')
+            continue;
+
+        if (c == '*')
+            return TRUE;
+        if (c == 'W' && i + 1 < s->length
+                && buffer_get(b, s->offset + i + 1) == '/')
+            i += 2;
+
+        if (s->length - i >= n
+                && buffer_starts_with(b, s->offset + i, f->etag, n)
+                && (s->length - i == n
+                    || strchr(", \t", buffer_get(b, s->offset + i + n))))
+            return TRUE;
+
+        while (i < s->length && buffer_get(b, s->offset + i) != ',')
+            i++;
+    }
+    return FALSE;
+}
+
+/**
+ * Checks if a validator, as in If-Range, is the ETag of a file or the
+ * date of its last modification.
+ */
+static int match_validator(struct file_entry *f, struct parser *p,
+        struct slice *s) {
+    return slice_equals(p, s, f->etag, strlen(f->etag))
+            || slice_equals(p, s, f->modified, strlen(f->modified));
+}
+
+/**
+ * Closes the file of an entry and returns the entry to the free list.
+ */
+static void free_entry(struct file_entry *f) {
+    close(f->fd);
+    f->fd = -1;
+    f->next = f->cache->free;
+    f->cache->free = f;
+}
+
+/**
+ * Opens a file under the document root, in a free entry. Returns NULL if
+ * it is not a regular file.
+ */
+static struct file_entry* open_file(struct file_cache *c, const char path[]) {
+    struct file_entry *f;
+    struct stat st;
+    int fd;
+
+    // relative to the root, even with several leading slashes
+    fd = openat(root_fd, path + strspn(path, "/"), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    // there is always a free entry, see init_file_cache
+    f = c->free;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || f == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    c->free = f->next;
+    f->fd = fd;
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    f->watch = -1;
+    f->references = 0;
+    f->stale = TRUE;
+    strcpy(f->path, path);
+    build_headers(f);
+    return f;
+}
+
+/**
+ * Makes a cached entry the most recently used one.
+ */
+static void touch_entry(struct file_cache *c, struct file_entry *f) {
+    if (c->newest == f)
+        return;
+
+    // unlink, then link in front
+    f->newer->older = f->older;
+    if (f->older != NULL)
+        f->older->newer = f->newer;
+    else
+        c->oldest = f->newer;
+
+    f->newer = NULL;
+    f->older = c->newest;
+    c->newest->newer = f;
+    c->newest = f;
+}
+
+/**
+ * Removes an entry from the cache, leaving it stale.
+ */
+static void uncache_entry(struct file_cache *c, struct file_entry *f) {
+    struct file_entry **e;
+
+    for (e = &(c->buckets[bucket_index(f->path)]); *e != f; e = &((*e)->next))
+        ;
+    *e = f->next;
+
+    if (f->newer != NULL)
+        f->newer->older = f->older;
+    else
+        c->newest = f->older;
+    if (f->older != NULL)
+        f->older->newer = f->newer;
+    else
+        c->oldest = f->newer;
+
+    c->count--;
+    f->stale = TRUE;
+}
+
+/**
+ * Evicts the least recently used file that is not being sent. Returns
+ * FALSE if every cached file is.
+ */
+static int evict_file(struct file_cache *c) {
+    struct file_entry *f, *g;
+
+    for (f = c->oldest; f != NULL && f->references > 0; f = f->newer)
+        ;
+    if (f == NULL)
+        return FALSE;
+
+    debug("file evicted: %s", f->path);
+    uncache_entry(c, f);
+
+    // the watch may be shared by other paths to the same file
+    for (g = c->newest; g != NULL && g->watch != f->watch; g = g->older)
+        ;
+    if (g == NULL)
+        inotify_rm_watch(c->notify, f->watch);
+
+    free_entry(f);
+    return TRUE;
+}
+
+/**
+ * Adds a file to the cache, watching it for changes, and evicting another
+ * one if full. Files that cannot be watched are not cached.
+ */
+static void cache_file(struct file_cache *c, struct file_entry *f, int i) {
+    char full[FILE_PATH_SIZE * 2];
+
+    if (c->notify < 0 || (c->count == FILE_CACHE_SIZE && !evict_file(c)))
+        return;
+
+    snprintf(full, sizeof(full), "%s%s", root_path, f->path);
+    f->watch = inotify_add_watch(c->notify, full, FILE_EVENTS);
+    if (f->watch < 0)
+        return;
+
+    f->stale = FALSE;
+    f->next = c->buckets[i];
+    c->buckets[i] = f;
+
+    f->newer = NULL;
+    f->older = c->newest;
+    if (c->newest != NULL)
+        c->newest->newer = f;
+    else
+        c->oldest = f;
+    c->newest = f;
+    c->count++;
+}
+
+/**
+ * Drops every entry of a watched file (several paths may lead to it).
+ */
+static void drop_watch(struct file_cache *c, int watch) {
+    struct file_entry *f, *next;
+
+    for (f = c->newest; f != NULL; f = next) {
+        next = f->older;
+        if (f->watch != watch)
+            continue;
+
+        debug("file changed: %s", f->path);
+        uncache_entry(c, f);
+        if (f->references == 0)
+            free_entry(f);
+    }
+    inotify_rm_watch(c->notify, watch);
+}
+
+
+// see header file
+
+int set_document_root(const char path[]) {
+    root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return FALSE;
+
+    root_path = realpath(path, NULL);
+    return root_path != NULL;
+}
+
+int has_document_root(void) {
+    return root_fd >= 0;
+}
+
+size_t file_cache_size(int handlers) {
+    if (!has_document_root())
+        return 0;
+    return align((FILE_CACHE_SIZE + handlers) * sizeof(struct file_entry),
+            CACHE_LINE_SIZE);
+}
+
+int init_file_cache(struct file_cache *c, struct arena *arena,
+        int handlers) {
+    struct file_entry *f;
+    int i;
+
+    memset(c, 0, sizeof(struct file_cache));
+    c->notify = -1;
+    if (!has_document_root())
+        return TRUE;
+
+    // one entry per cached file, and one per handler for the files sent
+    // without being cached
+    c->size = FILE_CACHE_SIZE + handlers;
+    c->entries = (struct file_entry*) arena_alloc(arena,
+            c->size * sizeof(struct file_entry));
+    if (c->entries == NULL)
+        return FALSE;
+
+    for (i = c->size - 1; i >= 0; i--) {
+        f = &(c->entries[i]);
+        f->cache = c;
+        f->fd = -1;
+        f->next = c->free;
+        c->free = f;
+    }
+
+    c->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return TRUE;
+}
+
+void free_file_cache(struct file_cache *c) {
+    int i;
+
+    for (i = 0; i < c->size; i++)
+        if (c->entries[i].fd >= 0)
+            close(c->entries[i].fd);
+
+    if (c->notify >= 0)
+        close(c->notify);
+    c->count = 0;
+}
+
+struct file_entry* get_file(struct file_cache *c, struct parser *p) {
+    char path[FILE_PATH_SIZE];
+    struct file_entry *f;
+    int i;
+
+    if (!copy_path(p, path))
+        return NULL;
+
+    i = bucket_index(path);
+    for (f = c->buckets[i]; f != NULL; f = f->next)
+        if (strcmp(f->path, path) == 0)
+            break;
+
+    if (f != NULL) {
+        touch_entry(c, f);
+    } else {
+        f = open_file(c, path);
+        if (f == NULL)
+            return NULL;
+
+        debug("file opened: %s", path);
+        cache_file(c, f, i);
+    }
+
+    f->references++;
+    return f;
+}
+
+int check_file(struct file_entry *f, struct parser *p, long *start,
+        long *end) {
+    struct request *q;
+
+    q = &(p->request);
+    *start = 0;
+    *end = f->size;
+
+    // dates are compared exactly, as sent in Last-Modified
+    if (q->if_none_match.length > 0) {
+        if (match_etag(f, p, &(q->if_none_match)))
+            return FILE_NOT_MODIFIED;
+    } else if (slice_equals(p, &(q->if_modified_since), f->modified,
+            strlen(f->modified))) {
+        return FILE_NOT_MODIFIED;
+    }
+
+    if (q->range == RANGE_NONE || q->method != METHOD_GET
+            || (q->if_range.length > 0
+                && !match_validator(f, p, &(q->if_range))))
+        return FILE_OK;
+
+    if (q->range == RANGE_SUFFIX) {
+        *start = max(f->size - q->range_last, 0);
+    } else {
+        *start = q->range_first;
+        if (q->range_last >= 0 && q->range_last < f->size)
+            *end = q->range_last + 1;
+    }
+
+    return (*start < f->size) ? FILE_PARTIAL : FILE_UNSATISFIABLE;
+}
+
+void release_file(struct file_entry *f) {
+    f->references--;
+    if (f->references == 0 && f->stale)
+        free_entry(f);
+}
+
+void update_file_cache(struct file_cache *c) {
+    char events[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *e;
+    int i, n;
+
+    if (c->notify < 0)
+        return;
+
+    while ((n = read(c->notify, events, sizeof(events))) > 0) {
+        for (i = 0; i < n; i += sizeof(struct inotify_event) + e->len) {
+            e = (struct inotify_event*) (events + i);
+            if (!(e->mask & IN_IGNORED))
+                drop_watch(c, e->wd);
+        }
+    }
+}
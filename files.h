@@ -0,0 +1,153 @@
+/**
+ * Static files. Each worker keeps its own cache of open files, keyed by
+ * request path, with their size, modification time and a prebuilt block
+ * of response headers, so a cache hit needs no open(2) or fstat(2) and
+ * its body is sent with sendfile(2), straight from the page cache.
+ *
+ * Entries come from a fixed pool in the worker arena, with one for each
+ * cached file and one for each handler, so that a file can always be
+ * opened, cached or not. When the cache is full, the least recently used
+ * file not being sent is evicted.
+ *
+ * Conditional and range requests are answered from the same block: its
+ * validators come first, then the representation headers and the length,
+ * so the headers of a 304 and of a 206 are prefixes of those of a 200.
+ * They follow the fixed headers of every response.
+ *
+ * Cached files are watched with inotify: once a file changes, is replaced
+ * or is removed, its entry is dropped, and its descriptor closed as soon
+ * as no response is still sending it.
+ */
+
+#ifndef FILES
+#define FILES
+
+#include <time.h>
+
+#include "arena.h"
+#include "config.h"
+#include "parser.h"
+
+
+// constants
+
+#define FILE_OK             0
+#define FILE_NOT_MODIFIED   1
+#define FILE_PARTIAL        2
+#define FILE_UNSATISFIABLE  3
+
+// quoted hexadecimal modification time and size
+#define ETAG_SIZE       40
+// IMF-fixdate
+#define HTTP_DATE_SIZE  32
+// validators, type and length headers
+#define FILE_HEADERS_SIZE   256
+
+
+// data types
+
+/**
+ * An open file, in its hash table bucket (or the free list) after _next_,
+ * and in the cache from _newer_ to _older_ use. Entries that did not fit
+ * in the cache, or that changed while in use, are _stale_: they are
+ * released after their last use.
+ *
+ * Its _headers_ (after the fixed headers) end after the first
+ * _not_modified_size_ bytes for a 304, after _partial_size_ bytes for a
+ * 206, which adds its own Content-Range and Content-Length, and after
+ * _headers_size_ bytes for a 200.
+ */
+struct file_entry {
+    struct file_entry *next;
+    struct file_entry *newer;
+    struct file_entry *older;
+    struct file_cache *cache;
+    int fd;
+    long size;
+    time_t mtime;
+    int watch;
+    int references;
+    int stale;
+    char etag[ETAG_SIZE];
+    char modified[HTTP_DATE_SIZE];
+    int headers_size;
+    int partial_size;
+    int not_modified_size;
+    char headers[FILE_HEADERS_SIZE];
+    char path[FILE_PATH_SIZE];
+};
+
+/**
+ * Open file cache of a worker, as a hash table of entries, from _newest_
+ * to _oldest_ use. Without inotify (_notify_ is negative), nothing is
+ * cached.
+ */
+struct file_cache {
+    int notify;
+    int count;
+    struct file_entry *entries;
+    int size;
+    struct file_entry *free;
+    struct file_entry *newest;
+    struct file_entry *oldest;
+    struct file_entry *buckets[FILE_CACHE_BUCKETS];
+};
+
+
+// functions
+
+/**
+ * Sets the directory files are served from. Must be called before any
+ * file cache is set up. Returns FALSE if it cannot be opened.
+ */
+int set_document_root(const char[]);
+
+/**
+ * Checks if a document root was set.
+ */
+int has_document_root(void);
+
+/**
+ * Gets the arena space taken by a file cache for the given number of
+ * handlers: none without a document root.
+ */
+size_t file_cache_size(int);
+
+/**
+ * Sets up an empty file cache, with its entries taken from the arena, for
+ * the given number of handlers. Returns FALSE if the arena is too small.
+ */
+int init_file_cache(struct file_cache*, struct arena*, int);
+
+/**
+ * Closes every open file.
+ */
+void free_file_cache(struct file_cache*);
+
+/**
+ * Gets the file for the request path, opening it if not cached, and holds
+ * it until release_file. Paths ending in a slash get their index.html.
+ * Returns NULL if there is no such regular file.
+ */
+struct file_entry* get_file(struct file_cache*, struct parser*);
+
+/**
+ * Evaluates the preconditions of a request for a file, If-None-Match (or
+ * If-Modified-Since without it), then its Range, unless If-Range names
+ * another version. Sets the bytes of the file to send, from _start_ up to
+ * _end_. Returns one of FILE_*.
+ */
+int check_file(struct file_entry*, struct parser*, long *start, long *end);
+
+/**
+ * Releases a file taken with get_file.
+ */
+void release_file(struct file_entry*);
+
+/**
+ * Drops the entries of the files changed since the last call. The inotify
+ * descriptor is non-blocking, so it can be called on any wakeup.
+ */
+void update_file_cache(struct file_cache*);
+
+#endif
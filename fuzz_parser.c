@@ -0,0 +1,134 @@
+/**
+ * Fuzz target for the parser, for libFuzzer (clang -fsanitize=fuzzer).
+ * Every input is parsed as a stream of pipelined requests fed all at
+ * once, and then again fed in smaller pieces: the results must be the
+ * same however the input is split.
+ *
+ * Built with -D FUZZ_STANDALONE instead, it runs without libFuzzer on the
+ * files given as arguments, or on random mutations of the corpus.
+ */
+
+#include <stdint.h>
+
+#include "harness.h"
+
+// constants
+
+#define STEP_COUNT 4
+
+
+// functions
+
+/**
+ * Checks that an input gives the same results fed whole and in pieces.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static struct parse_result whole[MAX_RESULTS], part[MAX_RESULTS];
+    static int ready = FALSE;
+    int i, n, m, steps[STEP_COUNT];
+
+    if (!ready) {
+        if (!init_harness())
+            abort();
+        ready = TRUE;
+    }
+
+    n = parse_stream((const char*) data, size, 0, whole, MAX_RESULTS);
+
+    steps[0] = 1;
+    steps[1] = 2;
+    steps[2] = 7;
+    steps[3] = (size > 0) ? 1 + data[size - 1] % 64 : 3;
+    for (i = 0; i < STEP_COUNT; i++) {
+        m = parse_stream((const char*) data, size, steps[i], part,
+                MAX_RESULTS);
+        if (m != n || memcmp(whole, part, n * sizeof(whole[0])) != 0) {
+            fprintf(stderr, "results differ when fed %d bytes at a time\n",
+                    steps[i]);
+            abort();
+        }
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+
+/**
+ * Runs an input read from a file.
+ */
+static int run_file(const char file[]) {
+    static char data[MAX_REQUEST_HEAD];
+    FILE *f;
+    int n;
+
+    f = fopen(file, "rb");
+    if (f == NULL)
+        return FALSE;
+
+    n = fread(data, 1, MAX_REQUEST_HEAD, f);
+    fclose(f);
+    LLVMFuzzerTestOneInput((const uint8_t*) data, n);
+    return TRUE;
+}
+
+/**
+ * Runs random mutations of the corpus: bytes flipped, inserted, removed
+ * or replaced with HTTP syntax characters.
+ */
+static void run_mutations(int iterations) {
+    static const char syntax[] = " \r\n:;,=?/\t\"";
+    const struct corpus_entry *e;
+    char data[4096];
+    int corpus, i, j, k, n;
+
+    for (corpus = 0; parser_corpus[corpus].name != NULL; corpus++)
+        ;
+
+    for (i = 0; i < iterations; i++) {
+        e = &(parser_corpus[rand() % corpus]);
+        n = strlen(e->data);
+        memcpy(data, e->data, n);
+
+        for (j = rand() % 4; j >= 0 && n > 0; j--) {
+            k = rand() % n;
+            switch (rand() % 4) {
+            case 0:
+                data[k] ^= 1 << (rand() % 8);
+                break;
+            case 1:
+                data[k] = syntax[rand() % (sizeof(syntax) - 1)];
+                break;
+            case 2:
+                memmove(data + k, data + k + 1, n - k - 1);
+                n--;
+                break;
+            case 3:
+                if (n < sizeof(data)) {
+                    memmove(data + k + 1, data + k, n - k);
+                    data[k] = syntax[rand() % (sizeof(syntax) - 1)];
+                    n++;
+                }
+                break;
+            }
+        }
+        LLVMFuzzerTestOneInput((const uint8_t*) data, n);
+    }
+}
+
+int main(int argc, char** argv) {
+    int i;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++)
+            if (!run_file(argv[i]))
+                fprintf(stderr, "Could not read %s\n", argv[i]);
+        return 0;
+    }
+
+    srand(1);
+    run_mutations(100000);
+    puts("no differences found");
+    return 0;
+}
+
+#endif
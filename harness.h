@@ -0,0 +1,67 @@
+/**
+ * Parser harness. Feeds requests to the parser from memory, in pieces of
+ * a given size, and summarizes what was parsed, for the parser benchmark
+ * and the fuzz target. A corpus of realistic requests is included.
+ */
+
+#ifndef HARNESS
+#define HARNESS
+
+#include "parser.h"
+
+
+// constants
+
+#define MAX_RESULTS     64
+
+
+// data types
+
+/**
+ * Summary of a parsed request. Slices are summarized by a hash of their
+ * contents, as their offsets depend on how the input was fed.
+ */
+struct parse_result {
+    int state;
+    int error;
+    int method;
+    int version;
+    int keep_alive;
+    int header_count;
+    long content_length;
+    int chunked;
+    long body;
+    int range;
+    long range_first;
+    long range_last;
+    unsigned long hash;
+};
+
+struct corpus_entry {
+    const char *name;
+    const char *data;
+};
+
+
+// global state
+
+extern const struct corpus_entry parser_corpus[];
+
+
+// functions
+
+/**
+ * Sets up parsing and the chunk pool of the current thread.
+ */
+int init_harness(void);
+
+/**
+ * Parses a stream of pipelined requests, fed _step_ bytes at a time (or
+ * all at once if 0), until the stream ends, a request fails or closes the
+ * connection, or _max_ requests were parsed. Returns the number of
+ * results, the last of which may be an error.
+ */
+int parse_stream(const char[], int n, int step, struct parse_result[],
+        int max);
+
+#endif
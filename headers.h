@@ -0,0 +1,83 @@
+/**
+ * Header names the parser recognizes. Generated by `shovel headers` from
+ * HEADERS in shovel.py, do not edit.
+ *
+ * A name is looked up by a perfect hash of its length and its first, middle
+ * and last characters, case folded, which gives the only header it can be.
+ */
+
+#ifndef HEADERS
+#define HEADERS
+
+// constants
+
+#define HEADER_OTHER                0
+#define HEADER_CONTENT_LENGTH       1
+#define HEADER_CONNECTION           2
+#define HEADER_RANGE                3
+#define HEADER_IF_RANGE             4
+#define HEADER_IF_NONE_MATCH        5
+#define HEADER_IF_MODIFIED_SINCE    6
+#define HEADER_TRANSFER_ENCODING    7
+#define HEADER_HOST                 8
+#define HEADER_CONTENT_TYPE         9
+#define HEADER_ACCEPT               10
+#define HEADER_ACCEPT_ENCODING      11
+#define HEADER_ACCEPT_LANGUAGE      12
+#define HEADER_USER_AGENT           13
+#define HEADER_COOKIE               14
+#define HEADER_REFERER              15
+#define HEADER_AUTHORIZATION        16
+#define HEADER_EXPECT               17
+#define HEADER_UPGRADE              18
+#define HEADER_CACHE_CONTROL        19
+#define HEADER_ORIGIN               20
+#define HEADER_COUNT                21
+
+#define HEADER_MIN_LENGTH   4
+#define HEADER_MAX_LENGTH   17
+#define HEADER_SLOTS        64
+
+#define header_hash(n, first, middle, last) \
+    (((n) * 1 + (first) * 1 + (middle) * 25 + (last)) \
+        & (HEADER_SLOTS - 1))
+
+// names and lengths, by HEADER_*
+#define HEADER_NAMES { \
+    NULL, \
+    "Content-Length", \
+    "Connection", \
+    "Range", \
+    "If-Range", \
+    "If-None-Match", \
+    "If-Modified-Since", \
+    "Transfer-Encoding", \
+    "Host", \
+    "Content-Type", \
+    "Accept", \
+    "Accept-Encoding", \
+    "Accept-Language", \
+    "User-Agent", \
+    "Cookie", \
+    "Referer", \
+    "Authorization", \
+    "Expect", \
+    "Upgrade", \
+    "Cache-Control", \
+    "Origin", \
+}
+
+#define HEADER_LENGTHS { \
+    0, 14, 10, 5, 8, 13, 17, 17, 4, 12, 6, 15, \
+    15, 10, 6, 7, 13, 6, 7, 13, 6 \
+}
+
+// HEADER_* by hash
+#define HEADER_TABLE { \
+     0, 14,  0, 18,  0,  0,  2, 19, 15,  0,  0,  0,  0,  0,  0,  4, \
+     0,  7,  0,  0,  0,  0,  0,  0,  0,  0,  3,  8,  0, 16,  0,  0, \
+     6, 12,  0,  0,  0,  0,  0,  0,  9,  0,  0,  0, 13,  0,  0,  0, \
+     0,  0, 20,  0, 11,  0,  0,  0, 10,  0,  0,  5, 17,  0,  1,  0 \
+}
+
+#endif
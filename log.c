@@ -0,0 +1,334 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
+
+#include "cache.h"
+#include "log.h"
+
+// constants
+
+// longest formatted record
+#define LINE_SIZE   (ERROR_SIZE + LOG_PATH_SIZE + 64)
+
+
+// data types
+
+/**
+ * Output batch of the flush thread.
+ */
+struct output {
+    FILE *file;
+    int size;
+    char data[LOG_BUFFER_SIZE];
+};
+
+
+// global state
+
+static struct log_ring *rings[MAX_WORKERS];
+static int ring_count;
+
+static __thread struct log_ring *log_ring;
+
+static pthread_t flush_thread;
+static int running;
+
+static struct output error_output;
+static struct output access_output;
+
+// errors output in the current second, and suppressed, by kind
+static long error_second;
+static int error_counts[E_COUNT];
+static unsigned long suppressed[E_COUNT];
+
+
+// macros
+
+#define load(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+
+// functions
+
+/**
+ * Gets the current wall clock time, in nanoseconds.
+ */
+static long wall_ns(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+/**
+ * Takes the next free record of the current thread's ring, or returns
+ * NULL (counting it as dropped) if the ring is full.
+ */
+static struct log_record* reserve_record(int type, int fd) {
+    struct log_record *r;
+    unsigned long head;
+
+    head = log_ring->head;
+    if (head - __atomic_load_n(&(log_ring->tail), __ATOMIC_ACQUIRE)
+            == LOG_RING_SIZE) {
+        __atomic_store_n(&(log_ring->dropped), log_ring->dropped + 1,
+                __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    r = &(log_ring->records[head & (LOG_RING_SIZE - 1)]);
+    r->time = wall_ns();
+    r->type = type;
+    r->fd = fd;
+    return r;
+}
+
+/**
+ * Publishes the record taken by reserve_record to the flush thread.
+ */
+static void commit_record(void) {
+    __atomic_store_n(&(log_ring->head), log_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes out the data batched so far.
+ */
+static void flush_output(struct output *o) {
+    if (o->size == 0)
+        return;
+
+    fwrite(o->data, 1, o->size, o->file);
+    fflush(o->file);
+    o->size = 0;
+}
+
+/**
+ * Appends a formatted line to an output batch, writing the batch out
+ * first if the line might not fit.
+ */
+static void output_line(struct output *o, const char *format, ...) {
+    va_list args;
+    int n;
+
+    if (LOG_BUFFER_SIZE - o->size < LINE_SIZE)
+        flush_output(o);
+
+    va_start(args, format);
+    n = vsnprintf(o->data + o->size, LINE_SIZE - 1, format, args);
+    va_end(args);
+
+    o->size += min(n, LINE_SIZE - 2);
+    o->data[o->size++] = '\n';
+}
+
+/**
+ * Formats a wall clock time as an ISO 8601 UTC timestamp, with
+ * milliseconds.
+ */
+static void format_time(char dst[], long ns) {
+    struct tm t;
+    time_t s;
+
+    s = ns / 1000000000L;
+    gmtime_r(&s, &t);
+    strftime(dst, 20, "%Y-%m-%dT%H:%M:%S", &t);
+    sprintf(dst + 19, ".%03ldZ", ns / 1000000L % 1000);
+}
+
+/**
+ * Reports the errors suppressed by the rate limit, starting a new second.
+ */
+static void report_suppressed(long second) {
+    char message[ERROR_SIZE];
+    int i;
+
+    for (i = 0; i < E_COUNT; i++) {
+        if (suppressed[i] > 0) {
+            format_error(message, ERROR_SIZE, i, 0);
+            output_line(&error_output, "%s (%lu more suppressed)",
+                    message, suppressed[i]);
+        }
+        suppressed[i] = 0;
+        error_counts[i] = 0;
+    }
+    error_second = second;
+}
+
+/**
+ * Outputs an error record, unless too many of the same kind were already
+ * output in the current second.
+ */
+static void output_error(struct log_record *r) {
+    char message[ERROR_SIZE], time[32];
+    int code;
+
+    code = (r->code >= 0 && r->code < E_COUNT) ? r->code : E_NONE;
+    if (error_counts[code]++ >= LOG_ERROR_RATE) {
+        suppressed[code]++;
+        return;
+    }
+
+    format_time(time, r->time);
+    format_error(message, ERROR_SIZE, r->code, r->value);
+    if (r->fd >= 0)
+        output_line(&error_output, "%s %s (fd %d)", time, message, r->fd);
+    else
+        output_line(&error_output, "%s %s", time, message);
+}
+
+/**
+ * Outputs an access log record.
+ */
+static void output_access(struct log_record *r) {
+    char time[32];
+
+    format_time(time, r->time);
+    output_line(&access_output, "%s %d %s %s %d %d %.6f", time, r->fd,
+            (r->method < 0) ? "-" : method_names[r->method], r->path,
+            status_codes[r->code], r->size, r->duration / 1e9);
+}
+
+/**
+ * Drains every ring, writing out the records in batches.
+ */
+static void flush_rings(void) {
+    struct log_ring *ring;
+    struct log_record *r;
+    unsigned long dropped, head, tail;
+    long second;
+    int i, n;
+
+    second = wall_ns() / 1000000000L;
+    if (second != error_second)
+        report_suppressed(second);
+
+    n = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n; i++) {
+        ring = rings[i];
+        tail = ring->tail;
+        head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+
+        for (; tail != head; tail++) {
+            r = &(ring->records[tail & (LOG_RING_SIZE - 1)]);
+            if (r->type == LOG_ERROR)
+                output_error(r);
+            else if (access_output.file != NULL)
+                output_access(r);
+        }
+        __atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+
+        dropped = load(ring->dropped);
+        if (dropped != ring->reported) {
+            output_line(&error_output, "WARNING %lu log records dropped",
+                    dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+
+    flush_output(&error_output);
+    if (access_output.file != NULL)
+        flush_output(&access_output);
+}
+
+/**
+ * Flush thread entry point.
+ */
+static void* run_flush(void *arg) {
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = LOG_FLUSH_INTERVAL * 1000000L;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        flush_rings();
+    }
+
+    // whatever the workers logged before stopping
+    flush_rings();
+    report_suppressed(0);
+    flush_output(&error_output);
+    return NULL;
+}
+
+
+// see header file
+
+void init_log_ring(struct log_ring *ring) {
+    ring->head = 0;
+    ring->dropped = 0;
+    ring->tail = 0;
+    ring->reported = 0;
+    rings[ring_count] = ring;
+    __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+}
+
+void set_log_ring(struct log_ring *ring) {
+    log_ring = ring;
+}
+
+int start_log(FILE *access) {
+    error_output.file = stderr;
+    access_output.file = access;
+    running = TRUE;
+    if (pthread_create(&flush_thread, NULL, run_flush, NULL) != 0) {
+        running = FALSE;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void stop_log(void) {
+    if (!running)
+        return;
+
+    __atomic_store_n(&running, FALSE, __ATOMIC_RELEASE);
+    pthread_join(flush_thread, NULL);
+}
+
+void log_error(int err, int code, int fd) {
+    struct log_record *r;
+
+    if (log_ring == NULL) {
+        error(err, code);
+        return;
+    }
+
+    r = reserve_record(LOG_ERROR, fd);
+    if (r == NULL)
+        return;
+
+    r->code = err;
+    r->value = code;
+    commit_record();
+}
+
+void log_access(struct parser *p, int status, int size, long duration) {
+    struct log_record *r;
+    char *s;
+    int i, k, n;
+
+    if (access_output.file == NULL || log_ring == NULL)
+        return;
+
+    r = reserve_record(LOG_ACCESS, p->fd);
+    if (r == NULL)
+        return;
+
+    r->code = status;
+    r->size = size;
+    r->duration = duration;
+    r->method = -1;
+    strcpy(r->path, "-");
+
+    // the request line is only known to be valid once parsed
+    if (p->state == PARSING_DONE) {
+        r->method = p->request.method;
+        n = min(p->request.path.length, LOG_PATH_SIZE - 1);
+        for (i = 0; i < n; i += k) {
+            s = buffer_span(&(p->buffer), p->request.path.offset + i, &k);
+            k = min(k, n - i);
+            memcpy(r->path + i, s, k);
+        }
+        r->path[n] = '\0';
+    }
+    commit_record();
+}
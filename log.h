@@ -0,0 +1,96 @@
+/**
+ * Asynchronous logging. Each worker writes log records to its own single
+ * producer, single consumer ring, which never blocks: when the ring is
+ * full the record is dropped and counted. A background thread drains
+ * every ring a few times per second, formats the records and writes them
+ * out in large batches, so the event loops never wait on stderr.
+ *
+ * Repeated errors are rate limited by the flush thread: at most
+ * LOG_ERROR_RATE errors of each kind are output per second, and the rest
+ * are reported as a count, like the dropped records.
+ */
+
+#ifndef LOG
+#define LOG
+
+#include "config.h"
+#include "errors.h"
+#include "parser.h"
+
+
+// constants
+
+#define LOG_ERROR   0
+#define LOG_ACCESS  1
+
+
+// data types
+
+/**
+ * A log record. Errors have an E_* code and the errno (or similar) value
+ * that came with it, while requests have the method, the response status
+ * code and size, the time taken to serve them and the start of the path.
+ */
+struct log_record {
+    long time;
+    int type;
+    int fd;
+    int code;
+    int value;
+    int method;
+    int size;
+    long duration;
+    char path[LOG_PATH_SIZE];
+};
+
+/**
+ * Per worker ring of log records. Only the worker moves the head and only
+ * the flush thread moves the tail, each in its own cache line.
+ */
+struct log_ring {
+    struct log_record records[LOG_RING_SIZE];
+    unsigned long head __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long dropped;
+    unsigned long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    unsigned long reported;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+
+// functions
+
+/**
+ * Registers the ring of a worker. Must be called from the thread that
+ * called start_log.
+ */
+void init_log_ring(struct log_ring*);
+
+/**
+ * Makes the current thread log to the given ring. Threads without a ring
+ * log synchronously.
+ */
+void set_log_ring(struct log_ring*);
+
+/**
+ * Starts the flush thread. Requests are logged to _access_ if it is not
+ * NULL. Must be called before any worker starts. Returns FALSE if the
+ * thread could not be started.
+ */
+int start_log(FILE *access);
+
+/**
+ * Stops the flush thread, once every ring has been drained.
+ */
+void stop_log(void);
+
+/**
+ * Logs an error on the given connection (or -1).
+ */
+void log_error(int err, int code, int fd);
+
+/**
+ * Logs a request, with its response status (one of STATUS_*) and size and
+ * the time taken to serve it, if the access log is enabled.
+ */
+void log_access(struct parser*, int status, int size, long duration);
+
+#endif
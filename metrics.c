@@ -0,0 +1,239 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "metrics.h"
+
+// constants
+
+static const char *phase_names[] = {
+    "first_byte", "parse", "build", "write"
+};
+
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+static const char *error_names[] = {
+    "none", "memory", "addrinfo", "socket", "bind", "listen",
+    "read", "parse", "write", "uring"
+};
+
+
+// global state
+
+static struct metrics *workers[MAX_WORKERS];
+static int worker_count;
+
+
+// macros
+
+#define load(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#define print(...) do { \
+    n += snprintf(dst + min(n, size), size - min(n, size), __VA_ARGS__); \
+} while (0)
+
+#define total(field) sum_counter(offsetof(struct metrics, field))
+
+
+// functions
+
+/**
+ * Adds up a counter (given by its offset in struct metrics) of all
+ * workers.
+ */
+static unsigned long sum_counter(size_t offset) {
+    unsigned long t;
+    int w;
+
+    t = 0;
+    for (w = 0; w < worker_count; w++)
+        t += load(*(unsigned long*) ((char*) workers[w] + offset));
+    return t;
+}
+
+/**
+ * Gets the histogram bucket of a value.
+ */
+static int bucket_index(unsigned long v) {
+    int e;
+
+    if (v < (1 << HISTOGRAM_BITS))
+        return v;
+
+    e = 63 - __builtin_clzl(v);
+    if (e >= HISTOGRAM_MAX_EXP)
+        return HISTOGRAM_BUCKETS - 1;
+
+    return ((e - HISTOGRAM_BITS + 1) << HISTOGRAM_BITS)
+            + ((v >> (e - HISTOGRAM_BITS)) & ((1 << HISTOGRAM_BITS) - 1));
+}
+
+/**
+ * Gets the value in the middle of a histogram bucket.
+ */
+static double bucket_value(int i) {
+    unsigned long lower;
+    int shift;
+
+    if (i < (1 << HISTOGRAM_BITS))
+        return i;
+
+    // buckets of each group are 2^shift wide
+    shift = (i >> HISTOGRAM_BITS) - 1;
+    lower = (unsigned long) ((1 << HISTOGRAM_BITS)
+            + (i & ((1 << HISTOGRAM_BITS) - 1))) << shift;
+    return lower + (double) (1UL << shift) / 2;
+}
+
+/**
+ * Adds up the histograms of a phase of all workers into _h_.
+ */
+static void sum_histograms(struct histogram *h, int phase) {
+    struct histogram *s;
+    int i, w;
+
+    memset(h, 0, sizeof(struct histogram));
+    for (w = 0; w < worker_count; w++) {
+        s = &(workers[w]->latency[phase]);
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+            h->counts[i] += load(s->counts[i]);
+        h->sum += load(s->sum);
+    }
+}
+
+/**
+ * Gets a quantile of a histogram with _n_ values, in nanoseconds.
+ */
+static double quantile(struct histogram *h, unsigned long n, double q) {
+    unsigned long c, target;
+    int i;
+
+    target = (unsigned long) (q * n);
+    c = 0;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        c += h->counts[i];
+        if (c > target)
+            return bucket_value(i);
+    }
+    return 0;
+}
+
+
+// see header file
+long now_ns(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+void record_latency(struct metrics *m, int phase, long ns) {
+    struct histogram *h;
+
+    if (ns < 0)
+        return;
+
+    h = &(m->latency[phase]);
+    count(h->counts[bucket_index(ns)], 1);
+    count(h->sum, ns);
+}
+
+void init_metrics(struct metrics *m, const int *handler_count,
+        int handler_limit) {
+    memset(m, 0, sizeof(struct metrics));
+    m->handler_count = handler_count;
+    m->handler_limit = handler_limit;
+    m->chunk_count = NULL;
+    workers[worker_count++] = m;
+}
+
+void set_chunk_count(struct metrics *m, const int *chunk_count) {
+    __atomic_store_n(&(m->chunk_count), chunk_count, __ATOMIC_RELEASE);
+}
+
+int format_metrics(char dst[], int size, int section) {
+    struct histogram h;
+    const int *chunk_count;
+    unsigned long c;
+    long active, chunks, limit;
+    int i, j, n, w;
+
+    n = 0;
+    switch (section) {
+    case 0:
+        print("# TYPE cserver_connections_accepted_total counter\n");
+        print("cserver_connections_accepted_total %lu\n", total(accepted));
+        break;
+
+    case 1:
+        print("# TYPE cserver_requests_total counter\n");
+        for (i = 0; i < METHOD_COUNT; i++)
+            print("cserver_requests_total{method=\"%s\"} %lu\n",
+                    method_names[i], total(requests[i]));
+        break;
+
+    case 2:
+        print("# TYPE cserver_responses_total counter\n");
+        for (i = 0; i < STATUS_COUNT; i++)
+            print("cserver_responses_total{status=\"%d\"} %lu\n",
+                    status_codes[i], total(responses[i]));
+        break;
+
+    case 3:
+        print("# TYPE cserver_errors_total counter\n");
+        for (i = 1; i < E_COUNT; i++)
+            print("cserver_errors_total{error=\"%s\"} %lu\n",
+                    error_names[i], total(errors[i]));
+        break;
+
+    case 4:
+        print("# TYPE cserver_received_bytes_total counter\n");
+        print("cserver_received_bytes_total %lu\n", total(received));
+        print("# TYPE cserver_sent_bytes_total counter\n");
+        print("cserver_sent_bytes_total %lu\n", total(sent));
+        break;
+
+    case 5:
+        active = 0;
+        chunks = 0;
+        limit = 0;
+        for (w = 0; w < worker_count; w++) {
+            active += load(*(workers[w]->handler_count));
+            limit += workers[w]->handler_limit;
+            chunk_count = __atomic_load_n(&(workers[w]->chunk_count),
+                    __ATOMIC_ACQUIRE);
+            if (chunk_count != NULL)
+                chunks += load(*chunk_count);
+        }
+
+        print("# TYPE cserver_active_handlers gauge\n");
+        print("cserver_active_handlers %ld\n", active);
+        print("# TYPE cserver_free_handlers gauge\n");
+        print("cserver_free_handlers %ld\n", limit - active);
+        print("# TYPE cserver_free_chunks gauge\n");
+        print("cserver_free_chunks %ld\n", chunks);
+        break;
+
+    default:
+        // a summary per request phase
+        i = section - 6;
+        if (i >= LATENCY_COUNT)
+            return -1;
+
+        if (i == 0)
+            print("# TYPE cserver_phase_seconds summary\n");
+        sum_histograms(&h, i);
+        for (c = 0, j = 0; j < HISTOGRAM_BUCKETS; j++)
+            c += h.counts[j];
+
+        for (j = 0; j < sizeof(quantiles) / sizeof(double); j++)
+            print("cserver_phase_seconds{phase=\"%s\",quantile=\"%g\"} "
+                    "%.9f\n", phase_names[i], quantiles[j],
+                    quantile(&h, c, quantiles[j]) / 1e9);
+        print("cserver_phase_seconds_sum{phase=\"%s\"} %.9f\n",
+                phase_names[i], h.sum / 1e9);
+        print("cserver_phase_seconds_count{phase=\"%s\"} %lu\n",
+                phase_names[i], c);
+        break;
+    }
+    return n;
+}
@@ -0,0 +1,101 @@
+/**
+ * Server metrics. Each worker counts into its own cache line aligned
+ * counters, with relaxed atomic loads and stores that compile to plain
+ * moves, so counting never contends. The counters of every worker are
+ * only added up when the metrics are requested.
+ *
+ * Latencies are recorded in log-linear histograms of fixed size: each
+ * power of two range of nanoseconds is split into 2^HISTOGRAM_BITS
+ * buckets, for a relative error of about 1/2^HISTOGRAM_BITS.
+ */
+
+#ifndef METRICS
+#define METRICS
+
+#include "cache.h"
+#include "config.h"
+#include "errors.h"
+#include "parser.h"
+
+
+// constants
+
+// request phases with latency histograms
+
+#define LATENCY_FIRST_BYTE  0
+#define LATENCY_PARSE       1
+#define LATENCY_BUILD       2
+#define LATENCY_WRITE       3
+#define LATENCY_COUNT       4
+
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_EXP - HISTOGRAM_BITS + 1) << HISTOGRAM_BITS)
+
+
+// macros
+
+/**
+ * Adds to a counter. Only its own worker writes it, so no atomic
+ * read-modify-write is needed.
+ */
+#define count(counter, n) __atomic_store_n(&(counter), \
+        __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+
+// data types
+
+struct histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long sum;
+};
+
+struct metrics {
+    unsigned long accepted;
+    unsigned long requests[METHOD_COUNT];
+    unsigned long responses[STATUS_COUNT];
+    unsigned long errors[E_COUNT];
+    unsigned long received;
+    unsigned long sent;
+    struct histogram latency[LATENCY_COUNT];
+
+    // gauges, owned by the worker
+    const int *handler_count;
+    const int *chunk_count;
+    int handler_limit;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+
+// functions
+
+/**
+ * Initializes the metrics of a worker, reading its handler count from the
+ * given location, out of the given number of handlers, and registers
+ * them to be reported. Must be called before the workers start.
+ */
+void init_metrics(struct metrics*, const int*, int);
+
+/**
+ * Sets where to read the free chunk count of a worker from. The chunk
+ * pool belongs to the worker thread, so this is called from it.
+ */
+void set_chunk_count(struct metrics*, const int*);
+
+/**
+ * Gets the current time in nanoseconds, from a monotonic clock.
+ */
+long now_ns(void);
+
+/**
+ * Records the latency of a request phase, in nanoseconds.
+ */
+void record_latency(struct metrics*, int, long);
+
+/**
+ * Formats a section of the metrics of all workers in the Prometheus text
+ * format, one metric family (or one phase of the latency summary) per
+ * section, numbered from 0. Returns the size of the text, which is
+ * truncated to the given size, or -1 past the last section.
+ */
+int format_metrics(char[], int, int);
+
+#endif
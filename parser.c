@@ -1,3 +1,6 @@
+// for splice(2)
+#define _GNU_SOURCE
+
 #include "parser.h"
 
 // constants
@@ -12,11 +15,26 @@
 
 #define CRLF "\r\n"
 
+// longest chunk size or trailer line
+#define MAX_CHUNK_LINE  4096
+
+const char *method_names[] = { "OTHER", "HEAD", "GET" };
+
 const char m_get[] = "GET ";
 const char m_head[] = "HEAD ";
 const char http_version[] = "HTTP/1.x";
 
-const char h_content_length[] = "Content-Length:";
+// recognized header names (see headers.h)
+const char *header_names[] = HEADER_NAMES;
+const unsigned char header_lengths[] = HEADER_LENGTHS;
+const unsigned char header_table[] = HEADER_TABLE;
+
+const char r_bytes[] = "bytes=";
+
+const char c_close[] = "close";
+const char c_keep_alive[] = "keep-alive";
+
+const char t_chunked[] = "chunked";
 
 const unsigned char uri_chars[] = {
 //  Control Characters and Spaces (starts at 0x00)
@@ -32,8 +50,8 @@ const unsigned char uri_chars[] = {
     0xFF,       0xFF,       0xFF,       0xF5,
 
 //  `abcdefg    hijklmno    pqrstuvw    xyz{|}~
-//  01111111    11111111    11111111    1110001
-    0x7F,       0xFF,       0xFF,       0xE1
+//  01111111    11111111    11111111    11100010
+    0x7F,       0xFF,       0xFF,       0xE2
 };
 
 const unsigned char token_chars[] = {
@@ -50,70 +68,193 @@ const unsigned char token_chars[] = {
     0x7F,       0xFF,       0xFF,       0xE3,
 
 //  `abcdefg    hijklmno    pqrstuvw    xyz{|}~
-//  11111111    11111111    11111111    1110101
-    0xFF,       0xFF,       0xFF,       0xE5
+//  11111111    11111111    11111111    11101010
+    0xFF,       0xFF,       0xFF,       0xEA
+};
+
+const unsigned char value_chars[] = {
+//  Control Characters (starts at 0x00), only HTAB is allowed
+//  0x07        0x0F        0x17        0x1F
+    0x00,       0x40,       0x00,       0x00,
+
+//  Printable Characters and Space (up to 0x7E)
+    0xFF,       0xFF,       0xFF,       0xFF,
+    0xFF,       0xFF,       0xFF,       0xFF,
+    0xFF,       0xFF,       0xFF,       0xFE
 };
 
+struct char_class uri_class, token_class, value_class;
+
+
+// global state
+
+// where dropped bodies are spliced to, through a pipe per thread
+static int null_fd = -1;
+static __thread int body_pipe[2] = { -1, -1 };
+
 
 // macros
 
 #define ready(p) ((p)->buffer.size - (p)->mark)
 
+#define is_value_char(c) in_class(value_chars, c)
+
+#define is_space(c) ((c) == ' ' || (c) == '\t')
+
+// case folding of header name characters, for hashing only
+#define fold(c) ((unsigned char) (c) | 0x20)
+
+// body bytes left, up to the end of the current chunk if chunked
+#define body_left(p) ((p)->request.chunked ? (p)->chunk \
+        : (p)->request.content_length - (p)->body)
+
+// whether the parser waits for nothing but body
+#define wants_body(p) ((p)->state == PARSING_BODY && !(p)->paused \
+        && ready(p) == 0 && body_left(p) > 0)
+
 
 // functions
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
+#include <unistd.h>
 
 /**
- * Reads data from the socket to the internal buffer.
+ * Appends data to the internal buffer. Returns FALSE if out of memory.
  */
-int read_socket(struct parser *p) {
-    struct chunk *c;
-    char buffer[BUFFER_SIZE];
-    int n, t;
+static int append_data(struct parser *p, const char data[], int n) {
+    if (!buffer_append(&(p->buffer), (char*) data, n)) {
+        p->state = PARSING_ERROR;
+        p->error = E_MEMORY;
+        return FALSE;
+    }
+    return TRUE;
+}
 
-    debug("reading socket");
+/**
+ * Counts body data as taken.
+ */
+static void count_body(struct parser *p, int n) {
+    p->body += n;
+    if (p->request.chunked)
+        p->chunk -= n;
+}
 
-    t = 0;
-    n = read(p->fd, buffer, BUFFER_SIZE);
-    while (n > 0) {
-        t += n;
-        buffer_append(&(p->buffer), buffer, n);
-        n = read(p->fd, buffer, BUFFER_SIZE);
+/**
+ * Passes body data to the body handler, or drops it.
+ */
+static void pass_body(struct parser *p, const char data[], int n) {
+    count_body(p, n);
+    if (p->on_body != NULL && !p->on_body(p, data, n)) {
+        debug("body paused");
+        p->paused = TRUE;
     }
+}
 
-    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
-        p->state = PARSING_ERROR;
-        p->error = E_READ;
-        return FALSE;
+/**
+ * Passes body data straight on, without buffering it, while the parser
+ * waits for nothing but body. Returns how much of the data was taken.
+ */
+static int take_body(struct parser *p, const char data[], int n) {
+    if (!wants_body(p))
+        return 0;
+
+    n = min(n, body_left(p));
+    pass_body(p, data, n);
+    return n;
+}
+
+/**
+ * Drops body data still in the socket without reading it, splicing it to
+ * /dev/null through a pipe. Returns what splice(2) does, or -1 with
+ * EINVAL if that is not possible.
+ */
+static int splice_body(struct parser *p) {
+    long n;
+
+    if (body_pipe[0] < 0 && (null_fd < 0
+            || pipe2(body_pipe, O_NONBLOCK | O_CLOEXEC) != 0)) {
+        errno = EINVAL;
+        return -1;
     }
 
-    debug("%d bytes read", t);
-    return TRUE;
+    n = splice(p->fd, NULL, body_pipe[1], NULL, body_left(p),
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        // /dev/null takes everything at once
+        splice(body_pipe[0], NULL, null_fd, NULL, n, SPLICE_F_MOVE);
+        count_body(p, n);
+    }
+    return n;
 }
 
+/**
+ * Advances the mark. Data before the mark is kept until the parser is
+ * reset, so slices of the request remain valid.
+ */
 void advance_mark(struct parser *p, int n) {
     p->mark += n;
-    if (p->mark > BUFFER_SIZE)
-        p->mark -= buffer_shift(&(p->buffer));
 }
 
 /**
  * Checks if given character is a valid HTTP token character.
  */
 int is_token_char(char c) {
-    int i = (unsigned) c >> 3;
-    int j = (unsigned) 0x80 >> (c & 0x07);
-    return (token_chars[i] & j) != 0;
+    return in_class(token_chars, c);
 }
 
 /**
  * Checks if given character is a valid URI character.
  */
 int is_uri_char(char c) {
-    int i = (unsigned) c >> 3;
-    int j = (unsigned) 0x80 >> (c & 0x07);
-    return (uri_chars[i] & j) != 0;
+    return in_class(uri_chars, c);
+}
+
+/**
+ * Counts the characters from the mark on that belong to the given class,
+ * up to the first one that does not or to the end of the data read. The
+ * buffer is scanned one contiguous span at a time.
+ */
+int scan_class(struct parser *p, const struct char_class *cc) {
+    char *s;
+    int i, m, n;
+
+    for (n = 0; (s = buffer_span(&(p->buffer), p->mark + n, &m)); n += m) {
+        i = scan_span(cc, s, m);
+        if (i < m)
+            return n + i;
+    }
+    return n;
+}
+
+/**
+ * Parses a token made of characters of the given class, followed by the
+ * given delimiter. The token must not be empty. While waiting for more
+ * data, its last character read is kept, so it is never empty on resume.
+ */
+int parse_token(struct parser *p, const struct char_class *cc, char delim) {
+    int n;
+
+    if (ready(p) < 2)
+        return PARSING_WAIT;
+
+    n = scan_class(p, cc);
+    if (n == 0)
+        return PARSING_ERROR;
+
+    if (n == ready(p)) {
+        advance_mark(p, n - 1);
+        return PARSING_WAIT;
+    }
+    advance_mark(p, n);
+
+    if (buffer_get(&(p->buffer), p->mark) != delim)
+        return PARSING_ERROR;
+    advance_mark(p, 1);
+
+    return PARSING_DONE;
 }
 
 
@@ -143,7 +284,9 @@ int parse_request_method(struct parser *p) {
     if (ready(p) == 0)
         return PARSING_WAIT;
 
-    first = buffer_get(&(p->buffer), p->mark);
+    // a method other than GET and HEAD may be resumed past its start, see
+    // parse_token
+    first = (p->mark == p->start) ? buffer_get(&(p->buffer), p->mark) : 0;
     if (first == m_get[0]) {
         r = parse_constant(p, m_get, sizeof(m_get) - 1);
         if (r != PARSING_DONE)
@@ -156,22 +299,12 @@ int parse_request_method(struct parser *p) {
             return r;
 
         p->request.method = METHOD_HEAD;
-    } else if (is_token_char(first)) {
+    } else if (first == 0 || is_token_char(first)) {
         // other methods
 
-        if (ready(p) < 2)
-            return PARSING_WAIT;
-        advance_mark(p, 1);
-
-        while (is_token_char(buffer_get(&(p->buffer), p->mark))) {
-            if (ready(p) < 2)
-                return PARSING_WAIT;
-            advance_mark(p, 1);
-        }
-
-        if (buffer_get(&(p->buffer), p->mark) != ' ')
-            return PARSING_ERROR;
-        advance_mark(p, 1);
+        r = parse_token(p, &token_class, ' ');
+        if (r != PARSING_DONE)
+            return r;
 
         p->request.method = METHOD_OTHER;
     } else
@@ -184,24 +317,26 @@ int parse_request_method(struct parser *p) {
  * Parses the request URI.
  */
 int parse_request_uri(struct parser *p) {
-    if (ready(p) < 2)
-        return PARSING_WAIT;
+    return parse_token(p, &uri_class, ' ');
+}
 
-    if (!is_uri_char(buffer_get(&(p->buffer), p->mark)))
-        return PARSING_ERROR;
-    advance_mark(p, 1);
+/**
+ * Sets the path and query slices of the URI just parsed, which starts at
+ * the token start.
+ */
+void slice_uri(struct parser *p) {
+    struct request *r;
+    int i, n;
 
-    while (is_uri_char(buffer_get(&(p->buffer), p->mark))) {
-        if (ready(p) < 2)
-            return PARSING_WAIT;
-        advance_mark(p, 1);
-    }
+    r = &(p->request);
+    n = p->mark - 1 - p->token;
 
-    if (buffer_get(&(p->buffer), p->mark) != ' ')
-        return PARSING_ERROR;
-    advance_mark(p, 1);
+    for (i = 0; i < n && buffer_get(&(p->buffer), p->token + i) != '?'; i++);
 
-    return PARSING_DONE;
+    r->path.offset = p->token;
+    r->path.length = i;
+    r->query.offset = p->token + min(i + 1, n);
+    r->query.length = n - r->query.offset + p->token;
 }
 
 /**
@@ -222,149 +357,291 @@ int parse_http_version(struct parser *p) {
     if (!isdigit(c))
         return PARSING_ERROR;
     p->request.version = c;
+    p->request.keep_alive = (c != '0');
     advance_mark(p, 1);
 
     return parse_constant(p, CRLF, 2);
 }
 
 /**
- * Parses an HTTP header name. Some headers are treated especially, as
- * Content-Length, while others are ignored.
+ * Recognizes a header name, in a single pass over it: its hash selects
+ * the only candidate, which is then compared case insensitively. Other
+ * names cost three characters and a table lookup, and are only compared
+ * if they have the length of the candidate. Returns one of HEADER_*.
  */
-int parse_header_name(struct parser *p) {
-    int n, r;
+int header_id(struct parser *p, struct slice *name) {
+    struct buffer *b;
+    int id, n;
+
+    b = &(p->buffer);
+    n = name->length;
+    if (n < HEADER_MIN_LENGTH || n > HEADER_MAX_LENGTH)
+        return HEADER_OTHER;
+
+    id = header_table[header_hash(n, fold(buffer_get(b, name->offset)),
+            fold(buffer_get(b, name->offset + n / 2)),
+            fold(buffer_get(b, name->offset + n - 1)))];
+
+    return (header_lengths[id] == n
+            && buffer_istarts_with(b, name->offset, header_names[id], n)) ?
+            id : HEADER_OTHER;
+}
 
-    n = sizeof(h_content_length) - 1;
-    if (ready(p) < n)
-        return PARSING_WAIT;
+/**
+ * Parses a header value. Deprecated header line folding is not supported.
+ */
+int parse_header_value(struct parser *p) {
+    advance_mark(p, scan_class(p, &value_class));
+    return parse_constant(p, CRLF, 2);
+}
 
-    // Note: If you need to check for other header names,
-    // implement an actual FSM instead of comparing to value
+/**
+ * Sets the slice of the header value just parsed, from the token start to
+ * the line end, without surrounding whitespace.
+ */
+void slice_header_value(struct parser *p, struct slice *s) {
+    int end;
 
-    if (p->state != PARSING_HEADER_NAME_ANY
-            && p->request.method == METHOD_OTHER && buffer_istarts_with(
-            &(p->buffer), p->mark, h_content_length, n)) {
-        // Content-Length
-        p->state = PARSING_HEADER_CONTENT_LENGTH;
-        advance_mark(p, n);
-        return PARSING_DONE;
-    }
+    s->offset = p->token;
+    end = p->mark - 2;
 
-    // other headers
+    while (s->offset < end && is_space(buffer_get(&(p->buffer), s->offset)))
+        s->offset++;
 
-    p->state = PARSING_HEADER_NAME_ANY;
-    if (ready(p) < 2)
-        return PARSING_WAIT;
+    while (end > s->offset && is_space(buffer_get(&(p->buffer), end - 1)))
+        end--;
 
-    if (!is_token_char(buffer_get(&(p->buffer), p->mark)))
+    s->length = end - s->offset;
+}
+
+/**
+ * Interprets a Content-Length header value. Repeated headers must all
+ * have the same value, or the body length would be ambiguous.
+ */
+int parse_content_length(struct parser *p, struct slice *s) {
+    long n;
+    char c;
+    int i;
+
+    if (s->length == 0)
         return PARSING_ERROR;
-    advance_mark(p, 1);
 
-    while (is_token_char(buffer_get(&(p->buffer), p->mark))) {
-        if (ready(p) < 2)
-            return PARSING_WAIT;
-        advance_mark(p, 1);
+    n = 0;
+    for (i = 0; i < s->length; i++) {
+        c = buffer_get(&(p->buffer), s->offset + i);
+        if (!isdigit(c) || n > (LONG_MAX - 9) / 10)
+            return PARSING_ERROR;
+        n = n * 10 + (c - '0');
     }
 
-    if (buffer_get(&(p->buffer), p->mark) != ':')
+    if (p->request.has_length && n != p->request.content_length)
         return PARSING_ERROR;
-    advance_mark(p, 1);
 
-    p->state = PARSING_HEADER_VALUE;
+    p->request.content_length = n;
+    p->request.has_length = TRUE;
     return PARSING_DONE;
 }
 
 /**
- * Parses a header value. Deprecated header line folding is not supported.
+ * Checks if the connection option at the given offset of a header value
+ * is the given token.
  */
-int parse_header_value(struct parser *p) {
+int is_connection_option(struct parser *p, struct slice *s, int i,
+        const char token[], int m) {
     char c;
 
-    if (ready(p) < 3)
-        return PARSING_WAIT;
-    c = buffer_get(&(p->buffer), p->mark);
+    if (s->length - i < m)
+        return FALSE;
 
-    while (isgraph(c) || c == ' ' || c == '\t') {
-        advance_mark(p, 1);
-        if (ready(p) < 3)
-            return PARSING_WAIT;
-        c = buffer_get(&(p->buffer), p->mark);
-    }
+    if (!buffer_istarts_with(&(p->buffer), s->offset + i, token, m))
+        return FALSE;
 
-    return parse_constant(p, CRLF, 2);
+    if (s->length - i == m)
+        return TRUE;
+
+    c = buffer_get(&(p->buffer), s->offset + i + m);
+    return (c == ',' || c == ' ' || c == '\t');
 }
 
 /**
- * Parses a Content-Length header value.
+ * Interprets a Connection header value. Only the "close" and "keep-alive"
+ * options are recognized, other options are ignored.
  */
-int parse_header_content_length(struct parser *p) {
-    char c, *buffer;
-    int i, m, r;
+int parse_connection(struct parser *p, struct slice *s) {
+    char c;
+    int i;
 
-    if (ready(p) < 3)
-        return PARSING_WAIT;
-    c = buffer_get(&(p->buffer), p->mark);
+    // comma separated options
 
-    for (m = 1; isdigit(c) || c == ' ' || c == '\t'; m++) {
-        if (ready(p) < 3 + m)
-            return PARSING_WAIT;
-        c = buffer_get(&(p->buffer), p->mark + m);
+    for (i = 0; i < s->length; i++) {
+        c = buffer_get(&(p->buffer), s->offset + i);
+        if (c == ',' || c == ' ' || c == '\t')
+            continue;
+
+        if (is_connection_option(p, s, i, c_close, sizeof(c_close) - 1))
+            p->request.keep_alive = FALSE;
+        else if (is_connection_option(p, s, i, c_keep_alive,
+                sizeof(c_keep_alive) - 1))
+            p->request.keep_alive = TRUE;
+
+        while (i < s->length
+                && buffer_get(&(p->buffer), s->offset + i) != ',')
+            i++;
     }
 
-    buffer = buffer_copy(&(p->buffer), p->mark, m - 1);
-    if (buffer == NULL) {
-        p->error = E_MEMORY;
+    return PARSING_DONE;
+}
+
+/**
+ * Interprets a Transfer-Encoding header value. Only bodies whose last
+ * coding is chunked can be delimited: any other is an error.
+ */
+int parse_transfer_encoding(struct parser *p, struct slice *s) {
+    int i, m;
+
+    m = sizeof(t_chunked) - 1;
+    for (i = s->length; i > 0; i--)
+        if (buffer_get(&(p->buffer), s->offset + i - 1) == ',')
+            break;
+    while (i < s->length && is_space(buffer_get(&(p->buffer), s->offset + i)))
+        i++;
+
+    if (s->length - i != m
+            || !buffer_istarts_with(&(p->buffer), s->offset + i, t_chunked, m))
         return PARSING_ERROR;
-    }
-    advance_mark(p, m - 1);
 
-    r = parse_constant(p, CRLF, 2);
-    if (r != PARSING_DONE) {
-        free(buffer);
-        return r;
+    p->request.chunked = TRUE;
+    return PARSING_DONE;
+}
+
+/**
+ * Reads a decimal number of a Range header value, at the given offset,
+ * which is moved past it. Returns -1 if there are no digits there, or -2
+ * if the number is too large.
+ */
+long parse_range_number(struct parser *p, struct slice *s, int *i) {
+    long n;
+    char c;
+
+    for (n = -1; *i < s->length; (*i)++) {
+        c = buffer_get(&(p->buffer), s->offset + *i);
+        if (!isdigit(c))
+            break;
+        if (n > (LONG_MAX - 9) / 10)
+            return -2;
+        n = max(n, 0) * 10 + (c - '0');
     }
+    return n;
+}
+
+/**
+ * Interprets a Range header value. Only a single byte range is
+ * recognized: the request is left without a range otherwise, so the whole
+ * representation is sent, as RFC 9110 allows.
+ */
+int parse_range(struct parser *p, struct slice *s) {
+    long first, last;
+    int i;
+
+    i = sizeof(r_bytes) - 1;
+    if (s->length <= i
+            || !buffer_istarts_with(&(p->buffer), s->offset, r_bytes, i))
+        return PARSING_DONE;
+
+    first = parse_range_number(p, s, &i);
+    if (first < -1 || i == s->length
+            || buffer_get(&(p->buffer), s->offset + i) != '-')
+        return PARSING_DONE;
+
+    i++;
+    last = parse_range_number(p, s, &i);
+    if (last < -1 || i != s->length)
+        return PARSING_DONE;
 
-    errno = 0;
-    p->request.content_length = strtol(buffer, NULL, 10);
-    free(buffer);
-    return (errno == 0) ? PARSING_DONE : PARSING_ERROR;
+    if (first >= 0 && (last == -1 || last >= first)) {
+        p->request.range = RANGE_BYTES;
+        p->request.range_first = first;
+        p->request.range_last = last;
+    } else if (first == -1 && last > 0) {
+        p->request.range = RANGE_SUFFIX;
+        p->request.range_first = -1;
+        p->request.range_last = last;
+    }
+    return PARSING_DONE;
 }
 
 /**
- * Parses HTTP headers. Only a few headers are actually processed, while most
- * values are discarded.
+ * Parses HTTP headers. Every header is recorded as a pair of slices, and
+ * a few of them are also interpreted.
  */
 int parse_headers(struct parser *p) {
+    struct header *h;
     int r;
 
     while (TRUE) {
+        h = &(p->request.headers[p->request.header_count]);
+
         switch (p->state) {
         case PARSING_HEADERS:
             r = parse_constant(p, CRLF, 2);
             if (r != PARSING_ERROR)
                 return r;
+
+            if (p->request.header_count == MAX_HEADERS)
+                return PARSING_ERROR;
+
             p->state = PARSING_HEADER_NAME;
+            p->token = p->mark;
             debug("parsing header");
 
         case PARSING_HEADER_NAME:
-        case PARSING_HEADER_NAME_ANY:
-            r = parse_header_name(p);
+            r = parse_token(p, &token_class, ':');
             if (r != PARSING_DONE)
                 return r;
+
+            h->name.offset = p->token;
+            h->name.length = p->mark - 1 - p->token;
+            h->id = header_id(p, &(h->name));
+            p->token = p->mark;
+            p->state = PARSING_HEADER_VALUE;
             debug("parsed header name");
         }
 
-        switch (p->state) {
-        case PARSING_HEADER_VALUE:
-            r = parse_header_value(p);
+        r = parse_header_value(p);
+        if (r != PARSING_DONE)
+            return r;
+
+        slice_header_value(p, &(h->value));
+        p->request.header_count++;
+
+        switch (h->id) {
+        case HEADER_CONTENT_LENGTH:
+            r = parse_content_length(p, &(h->value));
             break;
 
-        case PARSING_HEADER_CONTENT_LENGTH:
-            r = parse_header_content_length(p);
+        case HEADER_TRANSFER_ENCODING:
+            r = parse_transfer_encoding(p, &(h->value));
             break;
 
-        default:
-            return PARSING_ERROR;
+        case HEADER_CONNECTION:
+            r = parse_connection(p, &(h->value));
+            break;
+
+        case HEADER_RANGE:
+            r = parse_range(p, &(h->value));
+            break;
+
+        case HEADER_IF_RANGE:
+            p->request.if_range = h->value;
+            break;
+
+        case HEADER_IF_NONE_MATCH:
+            p->request.if_none_match = h->value;
+            break;
+
+        case HEADER_IF_MODIFIED_SINCE:
+            p->request.if_modified_since = h->value;
+            break;
         }
 
         if (r != PARSING_DONE)
@@ -376,22 +653,129 @@ int parse_headers(struct parser *p) {
 }
 
 /**
- * Reads the request body.
+ * Passes on the buffered part of the request body. Only the declared
+ * content length is consumed, any data past it belongs to the next
+ * (pipelined) request.
  */
 int parse_body(struct parser *p) {
-    int n;
+    char *s;
+    int k, n, t;
 
-    if (p->request.content_length == 0)
-        return PARSING_DONE;
+    for (t = 0; body_left(p) > 0 && !p->paused; t += k) {
+        n = min(ready(p) - t, body_left(p));
+        if (n == 0)
+            break;
 
-    n = ready(p);
-    if (n == 0)
-        return PARSING_WAIT;
+        s = buffer_span(&(p->buffer), p->mark + t, &k);
+        k = min(k, n);
+        pass_body(p, s, k);
+    }
 
-    p->body += n;
-    advance_mark(p, n);
-    return (p->body < p->request.content_length) ?
-            PARSING_WAIT : PARSING_DONE;
+    // the body is not kept, without moving the mark
+    buffer_erase(&(p->buffer), p->mark, t);
+    return (body_left(p) > 0) ? PARSING_WAIT : PARSING_DONE;
+}
+
+/**
+ * Gets the length of the line at the mark, with its line end, or 0 if it
+ * is not complete yet. Returns -1 if it is longer than the given size.
+ */
+int line_length(struct parser *p, int size) {
+    int i, n;
+
+    n = min(ready(p), size);
+    for (i = 0; i < n; i++)
+        if (buffer_get(&(p->buffer), p->mark + i) == '\n')
+            return i + 1;
+    return (n == size) ? -1 : 0;
+}
+
+/**
+ * Parses a chunk size line, dropping it. Chunk extensions are ignored.
+ */
+int parse_chunk_size(struct parser *p) {
+    long size;
+    char c;
+    int i, n;
+
+    n = line_length(p, MAX_CHUNK_LINE);
+    if (n <= 0)
+        return (n == 0) ? PARSING_WAIT : PARSING_ERROR;
+    if (n < 3 || buffer_get(&(p->buffer), p->mark + n - 2) != '\r')
+        return PARSING_ERROR;
+
+    size = 0;
+    for (i = 0; i < n - 2; i++) {
+        c = buffer_get(&(p->buffer), p->mark + i);
+        if (!isxdigit(c))
+            break;
+        if (size > (LONG_MAX >> 4))
+            return PARSING_ERROR;
+        size = (size << 4) | (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+
+    if (i == 0 || (i < n - 2 && c != ';' && !is_space(c)))
+        return PARSING_ERROR;
+
+    buffer_erase(&(p->buffer), p->mark, n);
+    p->chunk = size;
+    p->state = (size > 0) ? PARSING_BODY : PARSING_TRAILERS;
+    return PARSING_DONE;
+}
+
+/**
+ * Decodes a chunked body as it arrives. Chunk data is passed on as any
+ * body, while chunk sizes, line ends and trailers (which are ignored) are
+ * dropped from the buffer, so the state is the same however the data is
+ * split.
+ */
+int parse_chunked(struct parser *p) {
+    int n, r;
+
+    while (TRUE) {
+        switch (p->state) {
+        case PARSING_CHUNK_SIZE:
+            r = parse_chunk_size(p);
+            break;
+
+        case PARSING_BODY:
+            r = parse_body(p);
+            if (r == PARSING_DONE)
+                p->state = PARSING_CHUNK_END;
+            break;
+
+        case PARSING_CHUNK_END:
+            if (ready(p) < 2)
+                return PARSING_WAIT;
+            if (!buffer_starts_with(&(p->buffer), p->mark, CRLF, 2))
+                return PARSING_ERROR;
+
+            buffer_erase(&(p->buffer), p->mark, 2);
+            p->state = PARSING_CHUNK_SIZE;
+            r = PARSING_DONE;
+            break;
+
+        case PARSING_TRAILERS:
+            n = line_length(p, MAX_CHUNK_LINE);
+            if (n <= 0)
+                return (n == 0) ? PARSING_WAIT : PARSING_ERROR;
+            if (n < 2 || buffer_get(&(p->buffer), p->mark + n - 2) != '\r')
+                return PARSING_ERROR;
+
+            // the empty line ends the body
+            buffer_erase(&(p->buffer), p->mark, n);
+            if (n == 2)
+                return PARSING_DONE;
+            r = PARSING_DONE;
+            break;
+
+        default:
+            return PARSING_ERROR;
+        }
+
+        if (r != PARSING_DONE)
+            return r;
+    }
 }
 
 /**
@@ -400,11 +784,81 @@ int parse_body(struct parser *p) {
  * data read is actually discarded, in the current implementation.
  */
 void parse_request(struct parser *p) {
-    int r;
+    char buffer[BUFFER_SIZE];
+    int drop, n, t;
+
+    debug("reading socket");
+
+    // parse as data arrives, so that body data is not buffered, and read
+    // ahead of a complete request only as much as a request head
+    for (t = 0; !p->paused && p->state != PARSING_ERROR
+            && (p->state != PARSING_DONE || ready(p) < MAX_REQUEST_HEAD);
+            t += n) {
+        drop = wants_body(p) && p->on_body == NULL;
+        n = drop ? splice_body(p) : -1;
+        if (n < 0 && (!drop || errno == EINVAL)) {
+            n = read(p->fd, buffer, BUFFER_SIZE);
+            if (n > 0 && !receive_data(p, buffer, n))
+                return;
+        }
+        if (n == 0) {
+            debug("connection closed by peer");
+            p->closed = TRUE;
+            break;
+        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            p->state = PARSING_ERROR;
+            p->error = E_READ;
+            p->code = errno;
+            return;
+        } else if (n < 0) {
+            break;
+        }
+
+        p->received += n;
+        if (p->state != PARSING_DONE && p->state != PARSING_ERROR)
+            parse_buffered(p);
+    }
+
+    debug("%d bytes read", t);
+}
+
+int receive_data(struct parser *p, const char data[], int n) {
+    int k;
+
+    k = take_body(p, data, n);
+    return k == n || append_data(p, data + k, n - k);
+}
+
+void feed_parser(struct parser *p, const char data[], int n) {
+    if (!receive_data(p, data, n))
+        return;
+
+    parse_buffered(p);
+}
 
-    if(!read_socket(p))
+void set_body_handler(struct parser *p, body_handler on_body) {
+    p->on_body = on_body;
+}
+
+void resume_body(struct parser *p) {
+    p->paused = FALSE;
+    if (p->state == PARSING_BODY)
+        parse_buffered(p);
+}
+
+void close_body_pipe(void) {
+    if (body_pipe[0] < 0)
         return;
 
+    close(body_pipe[0]);
+    close(body_pipe[1]);
+    body_pipe[0] = -1;
+    body_pipe[1] = -1;
+}
+
+void parse_buffered(struct parser *p) {
+    int r;
+
     switch (p->state) {
     case PARSING_START:
         p->mark = 0;
@@ -415,6 +869,9 @@ void parse_request(struct parser *p) {
         r = parse_request_method(p);
         if (r != PARSING_DONE)
             break;
+        p->request.method_name.offset = p->start;
+        p->request.method_name.length = p->mark - 1 - p->start;
+        p->token = p->mark;
         p->state = PARSING_URI;
         debug("parsed method: %d", p->request.method);
 
@@ -422,6 +879,7 @@ void parse_request(struct parser *p) {
         r = parse_request_uri(p);
         if (r != PARSING_DONE)
             break;
+        slice_uri(p);
         p->state = PARSING_VERSION;
         debug("parsed uri");
 
@@ -434,18 +892,29 @@ void parse_request(struct parser *p) {
 
     case PARSING_HEADERS:
     case PARSING_HEADER_NAME:
-    case PARSING_HEADER_NAME_ANY:
     case PARSING_HEADER_VALUE:
-    case PARSING_HEADER_CONTENT_LENGTH:
         r = parse_headers(p);
+        if (r == PARSING_DONE && p->mark - p->start > MAX_REQUEST_HEAD)
+            r = PARSING_ERROR;
         if (r != PARSING_DONE)
             break;
         p->state = PARSING_BODY;
         debug("parsed headers");
         debug("content-length: %ld", p->request.content_length);
 
+        // a length along with chunks is suspect, close after this request
+        if (p->request.chunked) {
+            if (p->request.has_length)
+                p->request.keep_alive = FALSE;
+            p->request.content_length = 0;
+            p->state = PARSING_CHUNK_SIZE;
+        }
+
     case PARSING_BODY:
-        r = parse_body(p);
+    case PARSING_CHUNK_SIZE:
+    case PARSING_CHUNK_END:
+    case PARSING_TRAILERS:
+        r = p->request.chunked ? parse_chunked(p) : parse_body(p);
         if (r != PARSING_DONE)
             break;
         p->state = PARSING_DONE;
@@ -459,6 +928,10 @@ void parse_request(struct parser *p) {
         return;
     }
 
+    if (r == PARSING_WAIT && p->state < PARSING_BODY
+            && p->buffer.size - p->start > MAX_REQUEST_HEAD)
+        r = PARSING_ERROR;
+
     if (r == PARSING_ERROR) {
         p->state = PARSING_ERROR;
         if (p->error == E_NONE)
@@ -467,22 +940,95 @@ void parse_request(struct parser *p) {
     return;
 }
 
+void init_parsing(void) {
+    init_scan();
+    init_char_class(&uri_class, uri_chars);
+    init_char_class(&token_class, token_chars);
+    init_char_class(&value_class, value_chars);
+    null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+}
+
 void init_parser(struct parser* p) {
     p->state = PARSING_METHOD;
     p->error = E_NONE;
+    p->code = 0;
 
     p->fd = -1;
     p->mark = 0;
+    p->start = 0;
+    p->token = 0;
     p->body = 0;
+    p->chunk = 0;
+    p->on_body = NULL;
+    p->paused = FALSE;
+    p->closed = FALSE;
+    p->received = 0;
     init_buffer(&(p->buffer));
 
     p->request.version = '0';
+    p->request.keep_alive = FALSE;
     p->request.content_length = 0;
+    p->request.has_length = FALSE;
+    p->request.chunked = FALSE;
+    p->request.range = RANGE_NONE;
+    p->request.if_range.length = 0;
+    p->request.if_none_match.length = 0;
+    p->request.if_modified_since.length = 0;
+    p->request.header_count = 0;
 }
 
 void free_parser(struct parser *p) {
     clear_buffer(&(p->buffer));
 }
 
+void reset_parser(struct parser *p) {
+    struct buffer buffer;
+    body_handler on_body;
+    int closed, fd, mark;
+
+    fd = p->fd;
+    closed = p->closed;
+    on_body = p->on_body;
+
+    // keep pipelined data, dropping what was already consumed, and the
+    // buffer's inline storage
+
+    if (ready(p) == 0) {
+        clear_buffer(&(p->buffer));
+        p->mark = 0;
+    } else
+        p->mark -= buffer_discard(&(p->buffer), p->mark);
+
+    buffer = p->buffer;
+    mark = p->mark;
+    init_parser(p);
+    p->buffer = buffer;
+    p->mark = mark;
+    p->start = mark;
+    p->token = mark;
+
+    p->fd = fd;
+    p->closed = closed;
+    p->on_body = on_body;
+}
+
+struct header* find_header(struct parser *p, const char name[], int n) {
+    struct header *h;
+    int i;
+
+    for (i = 0; i < p->request.header_count; i++) {
+        h = &(p->request.headers[i]);
+        if (h->name.length == n
+                && buffer_istarts_with(&(p->buffer), h->name.offset, name, n))
+            return h;
+    }
+    return NULL;
+}
+
+int slice_equals(struct parser *p, struct slice *s, const char data[], int n) {
+    return s->length == n
+            && buffer_starts_with(&(p->buffer), s->offset, data, n);
+}
+
 #undef ensure_data
 
@@ -9,6 +9,8 @@
 
 #include "config.h"
 #include "errors.h"
+#include "headers.h"
+#include "scan.h"
 #include "util.h"
 
 
@@ -17,6 +19,7 @@
 #define METHOD_OTHER    0
 #define METHOD_HEAD     1
 #define METHOD_GET      2
+#define METHOD_COUNT    3
 
 #define PARSING_START           0
 #define PARSING_WAIT            1
@@ -29,37 +32,182 @@
 #define PARSING_HEADER_NAME     8
 #define PARSING_HEADER_VALUE    9
 #define PARSING_BODY            10
+#define PARSING_CHUNK_SIZE      11
+#define PARSING_CHUNK_END       12
+#define PARSING_TRAILERS        13
 
-#define PARSING_HEADER_NAME_ANY         20
-#define PARSING_HEADER_CONTENT_LENGTH   21
+#define RANGE_NONE      0
+#define RANGE_BYTES     1
+#define RANGE_SUFFIX    2
 
 
 // data types
 
+struct parser;
+
+/**
+ * Receives a fragment of a request body, as it arrives. The data is only
+ * valid during the call. Returns FALSE to pause the body: the parser then
+ * takes no more of it until resume_body.
+ */
+typedef int (*body_handler)(struct parser*, const char[], int);
+
+/**
+ * Part of the request data, as an offset into the parser buffer and a
+ * length. Slices are valid until the parser is reset.
+ */
+struct slice {
+    int offset;
+    int length;
+};
+
+/**
+ * Request header. _id_ is one of HEADER_*, for the headers the parser
+ * recognizes, or HEADER_OTHER.
+ */
+struct header {
+    int id;
+    struct slice name;
+    struct slice value;
+};
+
+/**
+ * Parsed request. Besides the few values interpreted by the parser, the
+ * method, the URI path and query and every header are kept as slices of
+ * the input, so handlers can read them without copying.
+ *
+ * A Range header with a single byte range sets _range_: RANGE_BYTES from
+ * _range_first_ to _range_last_ (inclusive, or -1 for the end), or
+ * RANGE_SUFFIX for the last _range_last_ bytes. The validators of
+ * conditional requests are kept as slices, empty when missing.
+ *
+ * A _chunked_ body has no content length: it is decoded as it arrives.
+ * _has_length_ tells if a Content-Length header was given.
+ */
 struct request {
     int method;
     char version;
+    int keep_alive;
     long content_length;
+    int has_length;
+    int chunked;
+    int range;
+    long range_first;
+    long range_last;
+    struct slice if_range;
+    struct slice if_none_match;
+    struct slice if_modified_since;
+    struct slice method_name;
+    struct slice path;
+    struct slice query;
+    int header_count;
+    struct header headers[MAX_HEADERS];
 };
 
+/**
+ * Request parser of a connection. Request bodies are not buffered: they
+ * are passed to the _on_body_ handler as they arrive, or dropped without
+ * it. _body_ counts the body bytes so far, and _chunk_ those left in the
+ * current chunk of a chunked body. _code_ is the errno of an E_READ error.
+ */
 struct parser {
     int state;
     int error;
+    int code;
     int fd;
     int mark;
-    int body;
+    int start;
+    int token;
+    long body;
+    long chunk;
+    body_handler on_body;
+    int paused;
+    int closed;
+    long received;
     struct buffer buffer;
     struct request request;
 };
 
 
+// global state
+
+/**
+ * The names of METHOD_*, as logged and reported in the metrics.
+ */
+extern const char *method_names[];
+
+
 // functions
 
+/**
+ * Sets up the character classes used for parsing. Must be called once,
+ * before any parsing.
+ */
+void init_parsing(void);
+
 void init_parser(struct parser*);
 
 void free_parser(struct parser*);
 
+/**
+ * Prepares the parser for the next request on the same connection. Data
+ * read past the end of the current request is kept.
+ */
+void reset_parser(struct parser*);
+
+/**
+ * Reads whatever the socket has and parses it, unless the body is paused.
+ * Bodies that have no handler are dropped straight from the socket.
+ */
 void parse_request(struct parser*);
 
+/**
+ * Sets the handler of request bodies on a connection, or NULL to drop
+ * them, which is the default. It is kept when the parser is reset.
+ */
+void set_body_handler(struct parser*, body_handler);
+
+/**
+ * Takes in the body again, after its handler paused it.
+ */
+void resume_body(struct parser*);
+
+/**
+ * Closes the pipe the current thread drops request bodies through, if it
+ * was opened.
+ */
+void close_body_pipe(void);
+
+/**
+ * Parses data already buffered, without reading the socket. Used to
+ * process pipelined requests left over from a previous read.
+ */
+void parse_buffered(struct parser*);
+
+/**
+ * Takes data received from the socket: body data goes straight to the
+ * body handler while nothing else is buffered, and the rest is buffered
+ * to be parsed. Returns FALSE if out of memory.
+ */
+int receive_data(struct parser*, const char[], int);
+
+/**
+ * Parses the given data, as if it had just been read from the socket. The
+ * parser state is the same however the input is split, so requests can
+ * be fed from memory in any number of pieces.
+ */
+void feed_parser(struct parser*, const char[], int);
+
+/**
+ * Finds a request header by name (without the colon), case insensitively.
+ * Returns NULL if there is no such header.
+ */
+struct header* find_header(struct parser*, const char[], int);
+
+/**
+ * Checks if a slice of the request equals the given data.
+ */
+int slice_equals(struct parser*, struct slice*, const char[], int);
+
 #endif
 
@@ -0,0 +1,99 @@
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+
+// kernels
+
+static int scan_scalar(const struct char_class *cc, const char *s, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (!in_class(cc->bitmap, s[i]))
+            return i;
+    return n;
+}
+
+#ifdef SCAN_SIMD
+
+__attribute__((target("ssse3")))
+static int scan_ssse3(const struct char_class *cc, const char *s, int n) {
+    __m128i lo, hi, nibble, zero, v, l, h;
+    int i, m;
+
+    lo = _mm_load_si128((const __m128i*) cc->lo);
+    hi = _mm_load_si128((const __m128i*) cc->hi);
+    nibble = _mm_set1_epi8(0x0F);
+    zero = _mm_setzero_si128();
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i*) (s + i));
+        l = _mm_shuffle_epi8(lo, _mm_and_si128(v, nibble));
+        h = _mm_shuffle_epi8(hi,
+                _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(l, h), zero));
+        if (m != 0)
+            return i + __builtin_ctz(m);
+    }
+    return i + scan_scalar(cc, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const struct char_class *cc, const char *s, int n) {
+    __m256i lo, hi, nibble, zero, v, l, h;
+    unsigned m;
+    int i;
+
+    lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) cc->lo));
+    hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*) cc->hi));
+    nibble = _mm256_set1_epi8(0x0F);
+    zero = _mm256_setzero_si256();
+
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i*) (s + i));
+        l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+        h = _mm256_shuffle_epi8(hi,
+                _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+
+        m = _mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_and_si256(l, h), zero));
+        if (m != 0)
+            return i + __builtin_ctz(m);
+    }
+    return i + scan_ssse3(cc, s + i, n - i);
+}
+
+#endif
+
+
+// see header file
+
+int (*scan_span)(const struct char_class*, const char*, int) = scan_scalar;
+
+void init_scan(void) {
+#ifdef SCAN_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_span = scan_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        scan_span = scan_ssse3;
+#endif
+}
+
+void init_char_class(struct char_class *cc, const unsigned char bitmap[]) {
+    int c, i;
+
+    cc->bitmap = bitmap;
+    for (i = 0; i < 16; i++) {
+        cc->lo[i] = 0;
+        cc->hi[i] = (i < 8) ? 1 << i : 0;
+    }
+
+    for (c = 0; c < 0x80; c++)
+        if (in_class(bitmap, c))
+            cc->lo[c & 0x0F] |= 1 << (c >> 4);
+}
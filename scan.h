@@ -0,0 +1,52 @@
+/**
+ * Character class scanning. Classes are given as 128 bit bitmaps over the
+ * ASCII range (bytes 0x80 and above never belong to a class), and scanned
+ * 16 or 32 bytes at a time with SSSE3 or AVX2 shuffles when the CPU
+ * supports them. The scalar fallback gives identical results.
+ */
+
+#ifndef SCAN
+#define SCAN
+
+
+// data types
+
+/**
+ * Character class. Besides the bitmap, a byte is split into its high and
+ * low nibbles, each looked up in a 16 entry table: the byte belongs to
+ * the class iff both entries have some bit in common.
+ */
+struct char_class {
+    unsigned char lo[16] __attribute__((aligned(16)));
+    unsigned char hi[16] __attribute__((aligned(16)));
+    const unsigned char *bitmap;
+};
+
+
+// macros
+
+#define in_class(table, c) ((unsigned char) (c) < 0x80 \
+        && ((table)[(unsigned char) (c) >> 3] & (0x80 >> ((c) & 0x07))) != 0)
+
+
+// functions
+
+/**
+ * Selects the scanning kernel for this CPU. Must be called once, before
+ * scanning.
+ */
+void init_scan(void);
+
+/**
+ * Builds the nibble tables of a class from its bitmap, which must outlive
+ * the class.
+ */
+void init_char_class(struct char_class*, const unsigned char[]);
+
+/**
+ * Counts the leading characters of the given data that belong to the
+ * class, that is, finds the first one that does not.
+ */
+extern int (*scan_span)(const struct char_class*, const char*, int);
+
+#endif
@@ -1,12 +1,5 @@
 #include "server.h"
 
-#define HTTP_VERSION "HTTP/1."
-#define CONTENT_LENGTH "Content-Length: "
-#define RESP_200 " 200 OK\r\n"
-#define RESP_400 " 400 Bad Request\r\n"
-#define RESP_500 " 500 Internal Server Error\r\n"
-#define RESP_501 " 501 Not Implemented\r\n"
-
 
 /**
  * Calls getaddrinfo(3) with hints suitable for an HTTP server. _service_
@@ -35,12 +28,23 @@ struct addrinfo* get_server_addrinfo(char service[]) {
         return r;
 }
 
+// how long the kernel may wait for the request before accepting
+static int defer_accept = DEFER_ACCEPT_TIMEOUT;
+
+void set_defer_accept(int seconds) {
+    defer_accept = seconds;
+}
+
 /**
  * Opens a listening server socket to accept TCP connections. The socket's
  * file descriptor is returned on success. _service_ can be a service name
- * (see services(5)) or a decimal port number.
+ * (see services(5)) or a decimal port number. With _reuse_port_, several
+ * sockets may listen on the same port, and the kernel distributes new
+ * connections among them. Accepted sockets inherit TCP_NODELAY from the
+ * listener, and unless disabled (see set_defer_accept), are only accepted
+ * once the request starts arriving.
  */
-int open_server_socket(char service[]) {
+int open_server_socket(char service[], int reuse_port) {
     struct addrinfo *ai, *aip;
     int fd, type, val;
 
@@ -60,6 +64,13 @@ int open_server_socket(char service[]) {
 
         val = TRUE;
         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+        if (reuse_port)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+        if (defer_accept > 0)
+            setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept,
+                    sizeof(defer_accept));
 
         if (bind(fd, aip->ai_addr, aip->ai_addrlen) != 0) {
             error(E_BIND, errno);
@@ -84,284 +95,1165 @@ int open_server_socket(char service[]) {
 }
 
 /**
- * Allocates a handler. If none could be, NULL is returned.
+ * Preallocates the handler pool, the chunk pool and the log ring of a
+ * server in a single arena. The chunks are only set aside here, as the
+ * chunk pool belongs to the worker thread (see init_chunk_pool). Returns
+ * FALSE if out of memory.
+ */
+int init_handler_pool(struct server *server) {
+    struct handler *h;
+    size_t size;
+    int i;
+
+    size = server->handler_limit
+            * align(sizeof(struct handler), CACHE_LINE_SIZE)
+            + MAX_BUFFERS * CHUNK_SIZE
+            + align(sizeof(struct log_ring), CACHE_LINE_SIZE)
+            + file_cache_size(server->handler_limit);
+    if (!init_arena(&(server->arena), size))
+        return FALSE;
+
+    server->log = (struct log_ring*) arena_alloc(&(server->arena),
+            sizeof(struct log_ring));
+    init_log_ring(server->log);
+
+    for (i = 0; i < server->handler_limit; i++) {
+        h = (struct handler*) arena_alloc(&(server->arena),
+                sizeof(struct handler));
+        h->next = server->handler_pool;
+        server->handler_pool = h;
+    }
+    return TRUE;
+}
+
+/**
+ * Takes a handler from the pool. If none is left, NULL is returned.
  */
 struct handler* new_handler(struct server *server) {
     struct handler *h;
 
-    if (server->handler_pool == NULL) {
-        if (server->handler_count >= MAX_HANDLERS)
-            return NULL;
+    h = server->handler_pool;
+    if (h == NULL)
+        return NULL;
 
-        h = (struct handler*) malloc(sizeof(struct handler));
-        if (h == NULL)
-            return NULL;
+    server->handler_pool = h->next;
+    count(server->handler_count, 1);
+    debug("request handler: %p", h);
 
-        server->handler_count++;
-        debug("new request handler: %p", h);
-    } else {
-        h = server->handler_pool;
-        server->handler_pool = h->next;
-        debug("old request handler: %p", h);
-    }
+    // the last few handlers are kept for health checks
+    h->reserved = server->handler_limit - server->handler_count
+            < RESERVED_HANDLERS;
 
     h->next = NULL;
     h->pool = server;
+    h->requests = 0;
+    h->keep_alive = FALSE;
+    h->phase = PHASE_NONE;
+    h->accepted_at = now_ns();
+    h->started_at = 0;
+    init_timeout(&(h->timeout));
     init_parser(&(h->parser));
+    buffer_set_inline(&(h->parser.buffer), h->request_data,
+            REQUEST_INLINE_SIZE);
     init_buffer(&(h->response.data));
-    h->response.mark = 0;
+    h->response.file = NULL;
+    buffer_set_inline(&(h->response.data), h->response_data,
+            RESPONSE_INLINE_SIZE);
+    clear_response(&(h->response));
     return h;
 }
 
 void free_handler(struct handler* h) {
     h->next = h->pool->handler_pool;
     h->pool->handler_pool = h;
-    clear_buffer(&(h->response.data));
+    count(h->pool->handler_count, -1);
+    clear_timeout(&(h->timeout));
+    clear_response(&(h->response));
     debug("handler returned: %p", h);
 }
 
-int build_response(struct handler *h) {
-    struct buffer *resp;
+void clear_response(struct response *r) {
+    clear_buffer(&(r->data));
+    r->count = 0;
+    r->current = 0;
+    r->size = 0;
+    r->mark = 0;
+    if (r->file != NULL)
+        release_file(r->file);
+    r->file = NULL;
+    r->stream = NULL;
+    r->chunked = FALSE;
+}
+
+int send_file(struct handler *h) {
+    struct response *r;
+    ssize_t n;
+
+    r = &(h->response);
+    n = sendfile(h->fd, r->file->fd, &(r->file_offset),
+            r->file_end - r->file_offset);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return TRUE;
+    else if (n <= 0)
+        return FALSE;
+
+    count(h->pool->metrics.sent, n);
+    return TRUE;
+}
+
+int queue_response(struct response *r, const char data[], int n) {
+    if (r->count == MAX_RESPONSE_PARTS)
+        return FALSE;
+
+    r->parts[r->count].iov_base = (void*) data;
+    r->parts[r->count].iov_len = n;
+    r->count++;
+    r->size += n;
+    return TRUE;
+}
+
+void advance_response(struct response *r, int n) {
+    struct iovec *part;
+    char *base;
+    int i, copied;
+
+    r->mark += n;
+    while (n > 0) {
+        part = &(r->parts[r->current]);
+        if (n < part->iov_len) {
+            part->iov_base = (char*) part->iov_base + n;
+            part->iov_len -= n;
+            break;
+        }
+
+        n -= part->iov_len;
+        r->current++;
+    }
+
+    // hold the Date header until the write completes
+
+    copied = FALSE;
+    for (i = r->current; i < r->count; i++) {
+        base = (char*) r->parts[i].iov_base;
+        if (base < date_header || base >= date_header + DATE_SIZE)
+            continue;
+
+        if (!copied) {
+            memcpy(r->date, date_header, DATE_SIZE);
+            copied = TRUE;
+        }
+        r->parts[i].iov_base = r->date + (base - date_header);
+    }
+}
+
+/**
+ * Queues a cached response, with the Date header after its status line.
+ */
+static int queue_cached(struct response *r, const struct cached_response *c) {
+    if (r->count + 3 > MAX_RESPONSE_PARTS)
+        return FALSE;
+
+    queue_response(r, c->data, c->split);
+    queue_response(r, date_header, DATE_SIZE);
+    queue_response(r, c->data + c->split, c->size - c->split);
+    return TRUE;
+}
+
+// the timeout of each phase, in seconds
+static int timeouts[] = {
+    IDLE_TIMEOUT, HEADER_TIMEOUT, BODY_TIMEOUT, WRITE_TIMEOUT
+};
+
+int set_phase_timeout(const char option[]) {
+    static const char *names[] = { "idle", "head", "body", "write" };
+    const char *value;
+    int i, n, seconds;
+
+    value = strchr(option, '=');
+    if (value == NULL)
+        return FALSE;
+
+    n = value - option;
+    seconds = atoi(value + 1);
+    for (i = PHASE_IDLE; i <= PHASE_WRITE; i++) {
+        if (strncmp(option, names[i], n) == 0 && names[i][n] == '\0'
+                && seconds > 0) {
+            timeouts[i] = seconds;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void update_timeout(struct handler *h) {
     struct parser *p;
-    int r;
+    int phase;
 
     p = &(h->parser);
-    resp = &(h->response.data);
+    if (h->state == ST_WRITING)
+        phase = PHASE_WRITE;
+    else if (p->state >= PARSING_BODY)
+        phase = PHASE_BODY;
+    else if (p->state == PARSING_METHOD && p->buffer.size == p->mark)
+        phase = PHASE_IDLE;
+    else
+        phase = PHASE_HEAD;
+
+    if (phase == h->phase && (phase == PHASE_IDLE || phase == PHASE_HEAD))
+        return;
+
+    h->phase = phase;
+    set_timeout(&(h->pool->timers), &(h->timeout), timeouts[phase]);
+}
+
+void shed_connection(struct server *server, int fd) {
+    const struct cached_response *r;
+    struct iovec parts[3];
+    char data[BUFFER_SIZE];
+    int i, n;
+
+    r = get_response(STATUS_503, '1', TRUE, FALSE);
+    parts[0].iov_base = (void*) r->data;
+    parts[0].iov_len = r->split;
+    parts[1].iov_base = date_header;
+    parts[1].iov_len = DATE_SIZE;
+    parts[2].iov_base = (void*) (r->data + r->split);
+    parts[2].iov_len = r->size - r->split;
+
+    // best effort, the socket is not waited for
+    n = writev(fd, parts, 3);
+    shutdown(fd, SHUT_WR);
+
+    // closing with unread data would send a reset, which may destroy the
+    // response before it is read, and the request is usually there already
+    // (see set_defer_accept)
+    for (i = 0; i < MAX_REQUEST_HEAD; i += BUFFER_SIZE)
+        if (read(fd, data, BUFFER_SIZE) <= 0)
+            break;
+    close(fd);
 
+    count(server->metrics.responses[STATUS_503], 1);
+    if (n > 0)
+        count(server->metrics.sent, n);
+}
 
-    // protocol and version
+/**
+ * Copies data into the response buffer and queues it.
+ */
+static int queue_copy(struct response *r, char data[], int n) {
+    struct iovec *parts;
+    int i, k, m;
 
-    r = buffer_append(resp, HTTP_VERSION, sizeof(HTTP_VERSION) - 1);
-    r = r && buffer_append_char(resp, p->request.version);
+    m = r->data.size;
+    if (!buffer_append(&(r->data), data, n))
+        return FALSE;
 
+    // the buffer chunks stay in place until the response is cleared
+    parts = r->parts + r->count;
+    k = buffer_gather(&(r->data), m, parts, MAX_RESPONSE_PARTS - r->count);
+    for (i = 0; i < k; i++)
+        m += parts[i].iov_len;
+    if (m < r->data.size)
+        return FALSE;
 
-    // status line
+    r->count += k;
+    r->size += n;
+    return TRUE;
+}
 
-    switch (p->state) {
-    case PARSING_ERROR:
-        error(p->error, 0);
-        h->error = p->error;
-        switch (p->error) {
-        case E_READ:
-        case E_PARSE:
-            r = r && buffer_append(resp, RESP_400, sizeof(RESP_400) - 1);
-            break;
+/**
+ * Queues the headers of a file response, whose body is then sent from the
+ * file itself. Revalidations get a 304 and ranges a 206 (or a 416), with
+ * a prefix of the same prebuilt headers. The response holds the file
+ * until it is cleared. Returns the STATUS_* of the response, or -1 if out
+ * of memory.
+ */
+static int queue_file(struct handler *h, struct file_entry *f, int body) {
+    const struct cached_response *c;
+    struct response *r;
+    const char *connection;
+    char range[128], version;
+    long start, end;
+    int k, n, status;
+
+    r = &(h->response);
+    r->file = f;
+
+    k = 0;
+    switch (check_file(f, &(h->parser), &start, &end)) {
+    case FILE_NOT_MODIFIED:
+        status = STATUS_304;
+        n = f->not_modified_size;
+        start = end = 0;
+        break;
 
-        case E_MEMORY:
-            r = r && buffer_append(resp, RESP_500, sizeof(RESP_500) - 1);
-            break;
-        }
+    case FILE_PARTIAL:
+        status = STATUS_206;
+        n = f->partial_size;
+        k = snprintf(range, sizeof(range), "Content-Range: bytes %ld-%ld/%ld"
+                "\r\nContent-Length: %ld\r\n", start, end - 1, f->size,
+                end - start);
         break;
 
-    case PARSING_DONE:
-        switch (p->request.method) {
-        case METHOD_GET:
-        case METHOD_HEAD:
-            r = r && buffer_append(resp, RESP_200, sizeof(RESP_200) - 1);
-            break;
+    case FILE_UNSATISFIABLE:
+        // only the headers of every response
+        status = STATUS_416;
+        n = 0;
+        k = snprintf(range, sizeof(range), "Content-Range: bytes */%ld\r\n"
+                "Content-Length: 0\r\n", f->size);
+        start = end = 0;
+        break;
 
-        default:
-            r = r && buffer_append(resp, RESP_501, sizeof(RESP_501) - 1);
-            break;
-        }
+    default:
+        status = STATUS_200;
+        n = f->headers_size;
+        break;
     }
 
+    r->file_offset = start;
+    r->file_end = body ? end : start;
+    if (r->count + 8 > MAX_RESPONSE_PARTS)
+        return -1;
+
+    // the status line of the cached response
+    version = h->parser.request.version;
+    c = get_response(status, version, FALSE, h->keep_alive);
+    connection = connection_header(version - '0', h->keep_alive);
+
+    queue_response(r, c->data, c->split);
+    queue_response(r, date_header, DATE_SIZE);
+    queue_response(r, response_cache.headers, strlen(response_cache.headers));
+    if (n > 0)
+        queue_response(r, f->headers, n);
+    if (k > 0 && !queue_copy(r, range, k))
+        return -1;
+    if (*connection != '\0')
+        queue_response(r, connection, strlen(connection));
+    queue_response(r, "\r\n", 2);
+    return status;
+}
+
+int start_stream(struct handler *h, int status, const char headers[],
+        stream_handler stream) {
+    const struct cached_response *c;
+    struct response *r;
+    const char *connection;
+    char version;
 
-    // content-length
+    r = &(h->response);
+    if (r->count + 7 > MAX_RESPONSE_PARTS)
+        return FALSE;
 
-    r = r && buffer_append(resp, CONTENT_LENGTH, sizeof(CONTENT_LENGTH) - 1);
-    if (p->state == PARSING_DONE && p->request.method != METHOD_OTHER) {
-        r = r && buffer_append(resp, "11\r\n", 4);
-    } else
-        r = r && buffer_append(resp, "0\r\n", 3);
+    // without chunks, the body ends with the connection
+    version = h->parser.request.version;
+    r->chunked = (version == '1');
+    if (!r->chunked)
+        h->keep_alive = FALSE;
+    if (h->parser.request.method != METHOD_HEAD)
+        r->stream = stream;
+    r->stream_part = 0;
+
+    c = get_response(status, version, FALSE, h->keep_alive);
+    connection = connection_header(version - '0', h->keep_alive);
+
+    queue_response(r, c->data, c->split);
+    queue_response(r, date_header, DATE_SIZE);
+    queue_response(r, response_cache.headers, strlen(response_cache.headers));
+    if (headers != NULL)
+        queue_response(r, headers, strlen(headers));
+    if (r->chunked)
+        queue_response(r, "Transfer-Encoding: chunked\r\n", 28);
+    if (*connection != '\0')
+        queue_response(r, connection, strlen(connection));
+    queue_response(r, "\r\n", 2);
+    return TRUE;
+}
 
+int queue_chunk(struct handler *h, char data[], int n) {
+    struct response *r;
+    char size[16];
+    int k;
 
-    // response body
+    // an empty chunk would end the body
+    r = &(h->response);
+    if (n == 0)
+        return TRUE;
 
-    r = r && buffer_append(resp, "\r\n", 2);
-    if (p->state == PARSING_DONE && p->request.method == METHOD_GET) {
-        r = r && buffer_append(resp, "hello world", 11);
+    if (r->chunked) {
+        k = sprintf(size, "%x\r\n", n);
+        if (!queue_copy(r, size, k))
+            return FALSE;
     }
 
+    if (!queue_copy(r, data, n))
+        return FALSE;
+    return !r->chunked || queue_response(r, "\r\n", 2);
+}
+
+int end_stream(struct handler *h) {
+    struct response *r;
 
-    // footer
+    r = &(h->response);
+    r->stream = NULL;
+    return !r->chunked || queue_response(r, "0\r\n\r\n", 5);
+}
+
+int continue_stream(struct handler *h) {
+    struct response *r;
+
+    r = &(h->response);
+    clear_buffer(&(r->data));
+    r->count = 0;
+    r->current = 0;
+    r->size = 0;
+    r->mark = 0;
+    return r->stream(h) && (r->size > 0 || r->stream == NULL);
+}
+
+/**
+ * Records the time taken to build a response, started at the given time,
+ * and logs the request. Requests already buffered behind it start their
+ * parse phase now.
+ */
+static void note_built(struct handler *h, long t, int status, int size) {
+    struct parser *p;
+
+    p = &(h->parser);
+    h->queued_at = now_ns();
+    record_latency(&(h->pool->metrics), LATENCY_BUILD, h->queued_at - t);
+    log_access(p, status, size,
+            h->queued_at - ((h->started_at != 0) ? h->started_at : t));
+    h->started_at = (p->buffer.size > p->mark) ? h->queued_at : 0;
+}
+
+/**
+ * Streams the metrics of all workers, a section per part, so that their
+ * size is not bounded by a single buffer.
+ */
+static int stream_metrics(struct handler *h) {
+    char text[METRICS_SIZE];
+    int n;
+
+    n = format_metrics(text, METRICS_SIZE, h->response.stream_part++);
+    if (n < 0)
+        return end_stream(h);
+    return queue_chunk(h, text, min(n, METRICS_SIZE - 1));
+}
+
+void note_read(struct handler *h, long t) {
+    if (h->started_at != 0 || h->parser.buffer.size == 0)
+        return;
+
+    h->started_at = t;
+    if (h->requests == 0)
+        record_latency(&(h->pool->metrics), LATENCY_FIRST_BYTE,
+                t - h->accepted_at);
+}
+
+void note_written(struct handler *h) {
+    record_latency(&(h->pool->metrics), LATENCY_WRITE,
+            now_ns() - h->queued_at);
+}
+
+int build_response(struct handler *h) {
+    const struct cached_response *r;
+    struct file_entry *f;
+    struct metrics *metrics;
+    struct parser *p;
+    long t;
+    int body, size, status;
+
+    p = &(h->parser);
+    metrics = &(h->pool->metrics);
+    size = h->response.size;
+
+    t = now_ns();
+    if (h->started_at != 0)
+        record_latency(metrics, LATENCY_PARSE, t - h->started_at);
+
+    body = (p->request.method != METHOD_HEAD);
+    h->keep_alive = p->state == PARSING_DONE && p->request.keep_alive
+            && h->requests + 1 < MAX_REQUESTS && !h->reserved;
+
+    if (p->state == PARSING_DONE)
+        count(metrics->requests[p->request.method], 1);
+
+    if (p->state == PARSING_ERROR) {
+        log_error(p->error, p->code, h->fd);
+        count(metrics->errors[p->error], 1);
+        h->error = p->error;
+        r = get_response((p->error == E_MEMORY) ? STATUS_500 : STATUS_400,
+                p->request.version, body, FALSE);
+    } else if (h->reserved) {
+        // overloaded, only health checks are served
+        r = get_health_check(p, body, FALSE);
+        if (r == NULL)
+            r = get_response(STATUS_503, p->request.version, body, FALSE);
+    } else if (p->request.method == METHOD_OTHER) {
+        r = get_response(STATUS_501, p->request.version, body,
+                h->keep_alive);
+    } else if (slice_equals(p, &(p->request.path), METRICS_PATH,
+            strlen(METRICS_PATH))) {
+        if (start_stream(h, STATUS_200,
+                "Content-Type: text/plain; version=0.0.4\r\n",
+                stream_metrics)) {
+            count(metrics->responses[STATUS_200], 1);
+            note_built(h, t, STATUS_200, h->response.size - size);
+            return TRUE;
+        }
 
-    if (!r) {
         h->state = ST_ERROR;
         h->error = E_MEMORY;
         return FALSE;
+    } else if ((r = get_route(p, body, h->keep_alive)) != NULL) {
+        // static route
+    } else if (has_document_root()) {
+        f = get_file(&(h->pool->files), p);
+        if (f != NULL) {
+            status = queue_file(h, f, body);
+            if (status < 0) {
+                h->state = ST_ERROR;
+                h->error = E_MEMORY;
+                return FALSE;
+            }
+
+            count(metrics->responses[status], 1);
+            note_built(h, t, status, h->response.size - size
+                    + (h->response.file_end - h->response.file_offset));
+            return TRUE;
+        }
+
+        r = get_response(STATUS_404, p->request.version, body,
+                h->keep_alive);
     } else {
-        debug("response built");
-        return TRUE;
+        r = get_response(STATUS_200, p->request.version, body,
+                h->keep_alive);
+    }
+
+    if (!queue_cached(&(h->response), r)) {
+        h->state = ST_ERROR;
+        h->error = E_MEMORY;
+        return FALSE;
     }
+
+    count(metrics->responses[r->status], 1);
+    debug("response built");
+    note_built(h, t, r->status, h->response.size - size);
+    return TRUE;
 }
 
 
 // event handlers
 
+/**
+ * Handles SIGUSR1 by dumping the metrics of all workers to stderr.
+ */
+static void sigusr1_cb(struct ev_loop *loop, ev_signal *w, int events) {
+    char text[METRICS_SIZE];
+    int i, n;
+
+    for (i = 0; (n = format_metrics(text, METRICS_SIZE, i)) >= 0; i++)
+        fwrite(text, 1, min(n, METRICS_SIZE - 1), stderr);
+}
+
 /**
  * Handles SIGINT by stopping the default event loop.
  */
 static void sigint_cb(struct ev_loop *loop, ev_signal *w, int events) {
-    struct server* server;
-    struct handler *h;
-
     puts("stopping");
     ev_break(loop, EVBREAK_ALL);
 }
 
-static void write_cb(struct ev_loop *loop, ev_io *w, int events) {
-    struct handler *h;
-    struct buffer *b;
-    int n;
+static void close_handler(struct ev_loop *loop, struct handler *h);
 
-    h = (struct handler*) w->data;
-    b = &(h->response.data);
+/**
+ * Drops a connection whose timeout expired.
+ */
+static void expire_cb(struct timeout *t, void *loop) {
+    debug("connection timed out");
+    close_handler((struct ev_loop*) loop, timeout_handler(t));
+}
 
-    h->response.mark += buffer_write(b, h->response.mark, h->fd);
-    if (errno == 0 && b->size - h->response.mark > 0) {
-        return;
-    } else if (errno != 0) {
-        error(E_WRITE, errno);
-    } else
-        debug("response written");
+/**
+ * Refreshes the Date header of a worker and expires the timeouts of its
+ * connections, once per second.
+ */
+static void date_cb(struct ev_loop *loop, ev_timer *w, int events) {
+    update_date();
+    advance_timer_wheel((struct timer_wheel*) w->data, expire_cb, loop);
+}
 
-    ev_io_stop(loop, w);
+/**
+ * Drops the cached files changed on disk.
+ */
+static void files_cb(struct ev_loop *loop, ev_io *w, int events) {
+    update_file_cache((struct file_cache*) w->data);
+}
+
+/**
+ * Stops a worker event loop, on request of the main thread.
+ */
+static void stop_cb(struct ev_loop *loop, ev_async *w, int events) {
+    ev_break(loop, EVBREAK_ALL);
+}
+
+/**
+ * Closes the client connection and returns the handler to the pool.
+ */
+static void close_handler(struct ev_loop *loop, struct handler *h) {
+    struct server *server;
+
+    ev_io_stop(loop, &(h->watcher));
+    free_parser(&(h->parser));
     close(h->fd);
+
     debug("client disconnected");
+    server = h->pool;
     free_handler(h);
+
+    if (server->paused) {
+        debug("accepting connections again");
+        server->paused = FALSE;
+        ev_io_start(loop, server->listener);
+    }
 }
 
+static void read_cb(struct ev_loop *loop, ev_io *w, int events);
+static void write_cb(struct ev_loop *loop, ev_io *w, int events);
+
 /**
- * Handles input events from client sockets.
+ * Builds responses for the complete requests already parsed, queueing
+ * up to MAX_PIPELINE of them to be sent with a single flush. The handler
+ * switches to writing if any response was queued, and is closed on
+ * failure or if the peer is gone.
  */
-static void read_cb(struct ev_loop *loop, ev_io *w, int events) {
-    struct handler *h;
+static void serve_requests(struct ev_loop *loop, struct handler *h) {
     struct parser *p;
+    struct ev_io *w;
+    int n;
 
-    h = (struct handler*) w->data;
     p = &(h->parser);
+    w = &(h->watcher);
+
+    // parse errors get a 400, or a 500 when out of buffers, which takes
+    // no memory as cached responses are queued by reference
+    for (n = 0; p->state == PARSING_DONE || p->state == PARSING_ERROR;) {
+        debug("request processed");
+
+        if (!build_response(h)) {
+            log_error(h->error, 0, h->fd);
+            close_handler(loop, h);
+            return;
+        }
+
+        // nothing can be queued after a file or a stream
+        n++;
+        if (!h->keep_alive || n >= MAX_PIPELINE || h->response.file != NULL
+                || h->response.stream != NULL)
+            break;
 
-    parse_request(p);
-    if (p->state == PARSING_WAIT) {
+        // pipelined requests
+
+        h->requests++;
+        reset_parser(p);
+        parse_buffered(p);
+    }
+
+    if (n == 0) {
+        if (p->closed)
+            close_handler(loop, h);
+        else
+            update_timeout(h);
         return;
     }
 
     ev_io_stop(loop, w);
-    if (p->state == PARSING_ERROR && p->error == E_MEMORY) {
-        free_parser(&(h->parser));
-        close(h->fd);
 
-        error(p->error, 0);
-        debug("client disconnected");
-        free_handler(h);
-        return;
+    h->state = ST_WRITING;
+    update_timeout(h);
+    ev_io_init(w, write_cb, h->fd, EV_WRITE);
+    w->data = h;
+    ev_io_start(loop, w);
+}
+
+/**
+ * Writes the queued responses, all parts with a single writev(2).
+ */
+static void write_cb(struct ev_loop *loop, ev_io *w, int events) {
+    struct handler *h;
+    struct response *r;
+    int n, ok;
+
+    h = (struct handler*) w->data;
+    r = &(h->response);
+
+    ok = TRUE;
+    if (r->mark < r->size) {
+        n = writev(h->fd, r->parts + r->current, r->count - r->current);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        ok = n >= 0;
+        if (ok) {
+            count(h->pool->metrics.sent, n);
+            advance_response(r, n);
+        }
     }
 
-    debug("request processed");
+    // the file body goes once every part is written, and a streamed body
+    // is produced as they are
+    if (ok && r->mark == r->size && file_pending(r)) {
+        ok = send_file(h);
+    } else if (ok && r->mark == r->size && r->stream != NULL
+            && !continue_stream(h)) {
+        log_error(E_MEMORY, 0, h->fd);
+        close_handler(loop, h);
+        return;
+    }
 
-    if (!build_response(h)) {
-        free_parser(&(h->parser));
-        close(h->fd);
+    if (!ok) {
+        log_error(E_WRITE, errno, h->fd);
+        count(h->pool->metrics.errors[E_WRITE], 1);
+        h->keep_alive = FALSE;
+    } else if (r->mark < r->size || file_pending(r) || r->stream != NULL) {
+        update_timeout(h);
+        return;
+    } else {
+        note_written(h);
+        debug("response written");
+    }
 
-        error(h->error, 0);
-        debug("client disconnected");
-        free_handler(h);
+    if (!h->keep_alive) {
+        close_handler(loop, h);
         return;
     }
 
-    h->state = ST_WRITING;
-    free_parser(&(h->parser));
+    // wait for the next request on the same connection
 
-    ev_io_init(w, write_cb, h->fd, EV_WRITE);
+    h->requests++;
+    h->state = ST_READING;
+    clear_response(r);
+
+    ev_io_stop(loop, w);
+    ev_io_init(w, read_cb, h->fd, EV_READ);
     w->data = h;
     ev_io_start(loop, w);
+
+    reset_parser(&(h->parser));
+    parse_buffered(&(h->parser));
+    serve_requests(loop, h);
+}
+
+/**
+ * Handles input events from client sockets.
+ */
+static void read_cb(struct ev_loop *loop, ev_io *w, int events) {
+    struct handler *h;
+    long t;
+
+    h = (struct handler*) w->data;
+    t = now_ns();
+    parse_request(&(h->parser));
+    note_read(h, t);
+    count(h->pool->metrics.received, h->parser.received);
+    h->parser.received = 0;
+
+    // the body handler cannot take more for now
+    if (h->parser.paused) {
+        ev_io_stop(loop, w);
+        update_timeout(h);
+        return;
+    }
+    serve_requests(loop, h);
+}
+
+#ifndef URING
+void resume_reading(struct handler *h) {
+    struct ev_loop *loop;
+
+    resume_body(&(h->parser));
+    if (h->parser.paused)
+        return;
+
+    loop = server_worker(h->pool)->loop;
+    ev_io_start(loop, &(h->watcher));
+    serve_requests(loop, h);
 }
+#endif
 
 /**
- * Handles I/O events from server socket.
+ * Handles I/O events from server socket, accepting up to ACCEPT_BATCH
+ * pending connections at once.
  */
 static void accept_cb(struct ev_loop *loop, ev_io *w, int events) {
     struct ev_io *watcher;
     struct server *server;
     struct handler *h;
-    struct timeval t;
-    int fd;
-
-    // check handler pool
+    int fd, i;
 
     server = (struct server*) w->data;
-    h = new_handler(server);
-    if (h == NULL) {
-        debug("out of handlers");
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        // check handler pool
+
+        if (server->handler_pool == NULL && !server->shed) {
+            // the listener would stay readable, stop watching it instead
+            debug("out of handlers, pausing");
+            ev_io_stop(loop, w);
+            server->paused = TRUE;
+            return;
+        }
+
+        // accept client connection
+
+        fd = accept4(server->socket, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+            return;
+
+        count(server->metrics.accepted, 1);
+        h = new_handler(server);
+        if (h == NULL) {
+            debug("out of handlers, shedding");
+            shed_connection(server, fd);
+            continue;
+        }
+
+        debug("client connected");
+
+        // configure new handler
+
+        h->state = ST_READING;
+        h->error = E_NONE;
+        h->parser.fd = fd;
+        h->fd = fd;
+
+        // configure new watcher
+
+        watcher = &(h->watcher);
+        ev_io_init(watcher, read_cb, fd, EV_READ);
+        watcher->data = h;
+        ev_io_start(loop, watcher);
+
+        // the request is usually there already, see set_defer_accept
+        read_cb(loop, watcher, EV_READ);
+    }
+}
+
+
+// workers
+
+/**
+ * Sets up a worker with its own event loop, listening socket and pool of
+ * the given number of handlers. Returns FALSE if the socket could not be
+ * opened.
+ */
+int init_worker(struct worker *w, char service[], int reuse_port, int cpu,
+        int handlers) {
+    w->cpu = cpu;
+    w->server.socket = open_server_socket(service, reuse_port);
+    w->server.handler_limit = handlers;
+    w->server.handler_pool = NULL;
+    w->server.handler_count = 0;
+    w->server.listener = &(w->socket_watcher);
+    w->server.shed = FALSE;
+    w->server.paused = FALSE;
+    init_timer_wheel(&(w->server.timers));
+    init_metrics(&(w->server.metrics), &(w->server.handler_count),
+            handlers);
+    if (w->server.socket < 0)
+        return FALSE;
+
+    if (!init_handler_pool(&(w->server))
+            || !init_file_cache(&(w->server.files), &(w->server.arena),
+                handlers)) {
         error(E_MEMORY, 0);
-        return;
+        close(w->server.socket);
+        return FALSE;
     }
 
-    // accept client connection
+#ifdef URING
+    if (!init_uring(w)) {
+        close(w->server.socket);
+        free_file_cache(&(w->server.files));
+        return FALSE;
+    }
+    return TRUE;
+#endif
 
-    fd = accept4(server->socket, NULL, NULL, SOCK_NONBLOCK);
-    if (fd < 0) {
-        free_handler(h);
-        return;
+    w->loop = ev_loop_new(EVFLAG_AUTO);
+    if (w->loop == NULL) {
+        close(w->server.socket);
+        free_file_cache(&(w->server.files));
+        return FALSE;
     }
 
-    debug("client connected");
+    ev_io_init(&(w->socket_watcher), accept_cb, w->server.socket, EV_READ);
+    w->socket_watcher.data = &(w->server);
+    ev_io_start(w->loop, &(w->socket_watcher));
 
-    // configure new socket
+    ev_async_init(&(w->stop_watcher), stop_cb);
+    ev_async_start(w->loop, &(w->stop_watcher));
 
-    t.tv_usec = 0;
-    t.tv_sec = 30;
+    ev_timer_init(&(w->date_watcher), date_cb, 1., 1.);
+    w->date_watcher.data = &(w->server.timers);
+    ev_timer_start(w->loop, &(w->date_watcher));
 
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t));
+    if (w->server.files.notify >= 0) {
+        ev_io_init(&(w->files_watcher), files_cb, w->server.files.notify,
+                EV_READ);
+        w->files_watcher.data = &(w->server.files);
+        ev_io_start(w->loop, &(w->files_watcher));
+    }
+    return TRUE;
+}
 
-    // configure new handler
+/**
+ * Worker thread entry point. Runs the worker event loop until stopped.
+ */
+void* run_worker(void *arg) {
+    struct worker *w;
+    cpu_set_t cpus;
+
+    w = (struct worker*) arg;
+    if (w->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(w->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        debug("worker pinned to cpu %d", w->cpu);
+    }
 
-    h->state = ST_READING;
-    h->error = E_NONE;
-    h->parser.fd = fd;
-    h->fd = fd;
+    // the Date header, the chunk pool and the log ring are kept per thread
+    set_log_ring(w->server.log);
+    update_date();
+    init_chunk_pool(&(w->server.arena), MAX_BUFFERS);
+    set_chunk_count(&(w->server.metrics), &(chunk_pool.size));
+
+#ifdef URING
+    run_uring(w);
+    free_uring(w);
+#else
+    ev_run(w->loop, 0);
+    ev_loop_destroy(w->loop);
+#endif
+
+    close(w->server.socket);
+    close_body_pipe();
+    free_file_cache(&(w->server.files));
+    return NULL;
+}
 
-    // configure new watcher
+/**
+ * Asks a worker to stop. Can be called from any thread.
+ */
+void stop_worker(struct worker *w) {
+#ifdef URING
+    stop_uring(w);
+#else
+    ev_async_send(w->loop, &(w->stop_watcher));
+#endif
+}
+
+/**
+ * Stops the given number of running workers, and waits for them.
+ */
+void stop_workers(struct worker workers[], int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        stop_worker(&(workers[i]));
+    for (i = 0; i < n; i++)
+        pthread_join(workers[i].thread, NULL);
+}
 
-    watcher = &(h->watcher);
-    ev_io_init(watcher, read_cb, fd, EV_READ);
-    watcher->data = h;
+/**
+ * Releases the arenas of the given number of workers. Their log rings
+ * live there, so the log must be stopped first.
+ */
+void free_workers(struct worker workers[], int n) {
+    int i;
 
-    ev_io_start(loop, watcher);
+    for (i = 0; i < n; i++)
+        free_arena(&(workers[i].server.arena));
+    free(workers);
 }
 
 
 // entry point
 
 int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "pin-cpus", no_argument, NULL, 'p' },
+        { "route", required_argument, NULL, 'r' },
+        { "header", required_argument, NULL, 'H' },
+        { "health", required_argument, NULL, 'c' },
+        { "shed", no_argument, NULL, 's' },
+        { "access-log", required_argument, NULL, 'a' },
+        { "root", required_argument, NULL, 'd' },
+        { "handlers", required_argument, NULL, 'n' },
+        { "timeout", required_argument, NULL, 't' },
+        { "defer-accept", required_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+
     struct ev_loop *loop;
-    struct ev_signal signal_watcher;
-    struct ev_io socket_watcher;
-    struct server server;
+    struct ev_signal signal_watcher, dump_watcher;
+    struct worker *workers;
+    void *memory;
+    FILE *access;
+    char *body, *service;
+    int cpus, handlers, i, n, opt, pin, shed;
 
     debug("enabled verbose output");
 
-    server.socket = open_server_socket(
-            (argc > 1) ? argv[1] : DEFAULT_SERVICE);
-    server.handler_pool = NULL;
-    server.handler_count = 0;
+    n = 1;
+    handlers = MAX_HANDLERS;
+    pin = FALSE;
+    shed = FALSE;
+    access = NULL;
+    while ((opt = getopt_long(argc, argv, "w:pr:H:c:sa:d:n:t:D:", options, NULL))
+            != -1) {
+        switch (opt) {
+        case 'w':
+            n = atoi(optarg);
+            break;
 
-    ev_signal_init(&signal_watcher, sigint_cb, SIGINT);
-    ev_io_init(&socket_watcher, accept_cb, server.socket, EV_READ);
+        case 'p':
+            pin = TRUE;
+            break;
 
-    socket_watcher.data = &server;
-    loop = EV_DEFAULT;
+        case 'r':
+            // static route, as PATH=BODY
+            body = strchr(optarg, '=');
+            if (body != NULL)
+                *(body++) = '\0';
+            if (body == NULL || !add_route(optarg, body))
+                n = 0;
+            break;
+
+        case 'H':
+            // extra header, as "Name: value"
+            if (!add_header(optarg))
+                n = 0;
+            break;
+
+        case 'c':
+            if (!add_health_check(optarg))
+                n = 0;
+            break;
 
+        case 's':
+            shed = TRUE;
+            break;
+
+        case 'a':
+            // access log file, or "-" for stdout
+            access = (strcmp(optarg, "-") == 0) ? stdout
+                    : fopen(optarg, "a");
+            if (access == NULL)
+                n = 0;
+            break;
+
+        case 'd':
+            // document root of static files
+            if (!set_document_root(optarg))
+                n = 0;
+            break;
+
+        case 'n':
+            // handlers per worker, some of them reserved
+            handlers = atoi(optarg);
+            if (handlers <= RESERVED_HANDLERS || handlers > MAX_HANDLERS)
+                n = 0;
+            break;
+
+        case 't':
+            // phase timeout, as PHASE=SECONDS
+            if (!set_phase_timeout(optarg))
+                n = 0;
+            break;
+
+        case 'D':
+            // seconds to wait for the request before accepting, 0 for none
+            if (atoi(optarg) < 0)
+                n = 0;
+            set_defer_accept(atoi(optarg));
+            break;
+
+        default:
+            n = 0;
+            break;
+        }
+    }
+
+    if (n < 1 || n > MAX_WORKERS) {
+        fprintf(stderr, "usage: %s [-w workers] [-p] [-r path=body]... "
+                "[-H header]... [-c path] [-s] [-n handlers] "
+                "[-t phase=seconds]... [-D seconds] [-a file] [-d dir] "
+                "[service]\n", argv[0]);
+        return 1;
+    }
+
+    service = (optind < argc) ? argv[optind] : DEFAULT_SERVICE;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // closed connections are handled on write
+    signal(SIGPIPE, SIG_IGN);
+    init_parsing();
+
+    if (!init_cache()) {
+        error(E_MEMORY, 0);
+        return 1;
+    }
+
+    // errors (and requests) are logged by a background thread
+
+    if (!start_log(access)) {
+        error(E_MEMORY, 0);
+        return 1;
+    }
+
+    // start workers
+
+    // their metrics are aligned to cache lines
+    if (posix_memalign(&memory, CACHE_LINE_SIZE,
+            n * sizeof(struct worker)) != 0) {
+        error(E_MEMORY, 0);
+        return 1;
+    }
+    workers = (struct worker*) memory;
+    memset(workers, 0, n * sizeof(struct worker));
+
+    for (i = 0; i < n; i++) {
+        if (!init_worker(&(workers[i]), service, n > 1,
+                pin ? i % cpus : -1, handlers)) {
+            stop_workers(workers, i);
+            stop_log();
+            free_workers(workers, i + 1);
+            return 1;
+        }
+
+        workers[i].server.shed = shed;
+        pthread_create(&(workers[i].thread), NULL, run_worker, &(workers[i]));
+    }
+    seal_cache();
+
+    // wait for SIGINT
+
+    loop = EV_DEFAULT;
+    ev_signal_init(&signal_watcher, sigint_cb, SIGINT);
     ev_signal_start(loop, &signal_watcher);
-    ev_io_start(loop, &socket_watcher);
+    ev_signal_init(&dump_watcher, sigusr1_cb, SIGUSR1);
+    ev_signal_start(loop, &dump_watcher);
 
     puts("server started");
     ev_run(loop, 0);
 
-    close(server.socket);
+    stop_workers(workers, n);
+
+    stop_log();
+    if (access != NULL && access != stdout)
+        fclose(access);
+    free_workers(workers, n);
     puts("server stopped");
     return 0;
 }
-
@@ -1,32 +1,85 @@
 /**
  * Dummy HTTP server. Use optional first argument to set port number
- * (defaults to 8080).
+ * (defaults to 8080). Use -w N (--workers N) to run N event loops on as
+ * many threads, and -p (--pin-cpus) to pin each of them to a CPU.
  */
 
 #ifndef SERVER
 #define SERVER
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <getopt.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 
 #include <ev.h>
 
+#include "cache.h"
 #include "errors.h"
+#include "files.h"
+#include "log.h"
+#include "metrics.h"
 #include "parser.h"
+#include "timer.h"
 #include "util.h"
 
+#ifdef URING
+#include "uring.h"
+#endif
+
 // data types
 
+struct handler;
+
+/**
+ * Produces more of a streamed response body, once the queued data is
+ * written, with queue_chunk, or ends it with end_stream. It must do
+ * either. Returns FALSE on failure.
+ */
+typedef int (*stream_handler)(struct handler*);
+
+/**
+ * Response queue. Responses are queued as parts (pointer and length) to
+ * be sent with a single writev(2), most of them pointing to cached
+ * responses. The data buffer holds responses built on demand. The body
+ * of a file goes last, sent with sendfile(2) once every part is written,
+ * from _file_offset_ up to _file_end_.
+ *
+ * A streamed body is produced by its _stream_ handler instead, a part at
+ * a time, each queued once the previous one is written, so its length
+ * need not be known up front and only one part is held at a time. It is
+ * sent in chunks if _chunked_, or else up to the connection close.
+ * _stream_part_ counts the parts produced so far, for the handler.
+ */
 struct response {
     struct buffer data;
+    char date[DATE_SIZE];
+    struct iovec parts[MAX_RESPONSE_PARTS];
+    int count;
+    int current;
+    int size;
     int mark;
+    struct file_entry *file;
+    off_t file_offset;
+    off_t file_end;
+    stream_handler stream;
+    int stream_part;
+    int chunked;
 };
 
 /**
@@ -38,18 +91,67 @@ struct handler {
     struct server* pool;
     struct handler* next;
     struct ev_io watcher;
+    struct timeout timeout;
+    int phase;
     struct parser parser;
     struct response response;
     int fd;
+    int requests;
+    int keep_alive;
+    int reserved;
+    long accepted_at;
+    long started_at;
+    long queued_at;
+#ifdef URING
+    int pending;
+    int receiving;
+    struct msghdr message;
+#endif
+
+    // inline storage for small requests and responses
+    char request_data[REQUEST_INLINE_SIZE];
+    char response_data[RESPONSE_INLINE_SIZE];
 };
 
 /**
- * Server state.
+ * Server state, with a pool of _handler_limit_ handlers. When out of
+ * handlers, the server either stops accepting connections until one is
+ * released (_paused_), or answers them with a 503 right away (_shed_).
+ * The last RESERVED_HANDLERS handlers only serve health checks.
  */
 struct server {
     int socket;
+    int handler_limit;
     int handler_count;
     struct handler* handler_pool;
+    struct arena arena;
+    struct timer_wheel timers;
+    struct metrics metrics;
+    struct file_cache files;
+    struct log_ring *log;
+    struct ev_io *listener;
+    int shed;
+    int paused;
+};
+
+/**
+ * Worker state. Each worker runs its own event loop on its own thread,
+ * with its own listening socket, handler pool and chunk pool, so nothing
+ * is shared between workers. Both pools are preallocated in the worker's
+ * arena.
+ */
+struct worker {
+    int cpu;
+    pthread_t thread;
+    struct ev_loop *loop;
+    struct ev_io socket_watcher;
+    struct ev_async stop_watcher;
+    struct ev_timer date_watcher;
+    struct ev_io files_watcher;
+    struct server server;
+#ifdef URING
+    struct uring uring;
+#endif
 };
 
 
@@ -61,5 +163,137 @@ struct server {
 #define ST_READING  3
 #define ST_WRITING  4
 
+// what a connection is waiting for, each phase with its own timeout
+
+#define PHASE_NONE  -1
+#define PHASE_IDLE  0
+#define PHASE_HEAD  1
+#define PHASE_BODY  2
+#define PHASE_WRITE 3
+
+#define timeout_handler(t) \
+    ((struct handler*) ((char*) (t) - offsetof(struct handler, timeout)))
+
+// the worker a server belongs to
+#define server_worker(s) \
+    ((struct worker*) ((char*) (s) - offsetof(struct worker, server)))
+
+// whether a file body is still to be sent after the response parts
+#define file_pending(r) \
+    ((r)->file != NULL && (r)->file_offset < (r)->file_end)
+
+
+// functions
+
+struct handler* new_handler(struct server*);
+
+void free_handler(struct handler*);
+
+/**
+ * Answers a connection with a 503 without taking a handler, and closes
+ * it. The socket must be non-blocking, as none of this is waited for.
+ */
+void shed_connection(struct server*, int);
+
+/**
+ * Notes that request data was read at the given time (see now_ns), which
+ * starts the parse phase if no request was pending.
+ */
+void note_read(struct handler*, long);
+
+/**
+ * Notes that the queued responses were written.
+ */
+void note_written(struct handler*);
+
+/**
+ * Queues the response for the request just parsed. Returns FALSE on
+ * failure.
+ */
+int build_response(struct handler*);
+
+/**
+ * Reads the request body again, once its handler can take more of it.
+ * Body handlers pause it by returning FALSE, which stops reading the
+ * connection.
+ */
+void resume_reading(struct handler*);
+
+/**
+ * Sets how long new connections may wait in the kernel for their first
+ * request data before being accepted (TCP_DEFER_ACCEPT), in seconds, or 0
+ * to accept them right away. The kernel rounds it to its retransmission
+ * timeouts, and accepts the connection anyway once it expires. Must be
+ * called before any listening socket is opened.
+ */
+void set_defer_accept(int);
+
+/**
+ * Sets the timeout of a phase from an option given as PHASE=SECONDS, where
+ * PHASE is idle, head, body or write. Returns FALSE if it is invalid. Must
+ * be called before any worker starts.
+ */
+int set_phase_timeout(const char[]);
+
+/**
+ * Sets the timeout of the handler for what it is waiting for now. The
+ * request head must arrive within its timeout, while the request body
+ * and the response only need to make progress, so their timeouts are
+ * extended by every call.
+ */
+void update_timeout(struct handler*);
+
+/**
+ * Clears the response queue, releasing its data.
+ */
+void clear_response(struct response*);
+
+/**
+ * Queues the head of a streamed response, with the given status (one of
+ * STATUS_*) and headers, which must end with a line end, if any, and
+ * remain valid until written. Its body is then produced by the stream
+ * handler, chunked for HTTP/1.1, or up to the connection close for
+ * HTTP/1.0. HEAD responses end after the head. Returns FALSE if the
+ * queue is full.
+ */
+int start_stream(struct handler*, int, const char[], stream_handler);
+
+/**
+ * Queues a part of a streamed body, copied into the response. Returns
+ * FALSE if out of memory or if the queue is full.
+ */
+int queue_chunk(struct handler*, char[], int);
+
+/**
+ * Ends a streamed body. Returns FALSE if the queue is full.
+ */
+int end_stream(struct handler*);
+
+/**
+ * Clears the written response queue of a streamed response and calls its
+ * stream handler. Returns FALSE if the handler failed, or queued nothing
+ * without ending the stream.
+ */
+int continue_stream(struct handler*);
+
+/**
+ * Sends as much of the queued file as the socket takes. Returns FALSE if
+ * the connection failed, or if the file is shorter than announced.
+ */
+int send_file(struct handler*);
+
+/**
+ * Queues data to be sent. The data must remain valid until it is written.
+ * Returns FALSE if the queue is full.
+ */
+int queue_response(struct response*, const char[], int);
+
+/**
+ * Skips the given number of bytes written from the queue. If some data is
+ * left, the Date header is copied to the response, so that it does not
+ * change while it is written.
+ */
+void advance_response(struct response*, int);
+
 #endif
 
@@ -1,23 +1,248 @@
+import json
+
 from pathlib import Path
-from subprocess import check_call, CalledProcessError
+from signal import SIGINT
+from socket import create_connection
+from subprocess import check_call, check_output, CalledProcessError, Popen
+from tempfile import NamedTemporaryFile
+from time import sleep
 from shovel import task
 
-SRC = 'errors.c', 'util.c', 'parser.c', 'server.c'
+SRC = ('arena.c', 'errors.c', 'util.c', 'scan.c', 'parser.c', 'cache.c',
+       'files.c', 'log.c', 'metrics.c', 'server.c', 'timer.c')
+URING_SRC = 'uring.c',
 EXE = 'cserver'
+BENCH_SRC = 'bench.c',
+BENCH_EXE = 'cbench'
+PARSER_SRC = ('arena.c', 'errors.c', 'util.c', 'scan.c', 'parser.c',
+              'harness.c')
+PARSER_BENCH_SRC = 'bench_parser.c',
+PARSER_BENCH_EXE = 'bench_parser'
+FUZZ_SRC = 'fuzz_parser.c',
+FUZZ_EXE = 'fuzz_parser'
+
+# header names the parser recognizes, in HEADER_* order, generated into
+# HEADERS_FILE by the headers task
+HEADERS = ('Content-Length', 'Connection', 'Range', 'If-Range',
+           'If-None-Match', 'If-Modified-Since', 'Transfer-Encoding', 'Host',
+           'Content-Type', 'Accept', 'Accept-Encoding', 'Accept-Language',
+           'User-Agent', 'Cookie', 'Referer', 'Authorization', 'Expect',
+           'Upgrade', 'Cache-Control', 'Origin')
+HEADERS_FILE = 'headers.h'
+HEADER_SLOTS = 64
+
+# standard benchmark matrix: connections, then method and body size
+BENCH_CONNECTIONS = (1, 64, 1024)
+BENCH_SHAPES = (('GET', 0), ('HEAD', 0), ('POST', 1024))
+BENCH_PORT = '8089'
 
 @task
-def compile(debug=False):
+def compile(debug=False, uring=False):
     try:
         cmd = ['gcc', '-o', str(Path(EXE))]
         if debug:
             cmd += ['-D', 'DEBUG']
+        if uring:
+            cmd += ['-D', 'URING']
         cmd += [str(Path(src)) for src in SRC]
-        cmd += ['-lev']
+        if uring:
+            cmd += [str(Path(src)) for src in URING_SRC]
+        cmd += ['-lev', '-pthread']
+        check_call(cmd)
+    except CalledProcessError as e:
+        print(e)
+
+def header_hash(name, a, b, c):
+    '''Same as the header_hash macro of the generated file.'''
+    n = len(name)
+    first, middle, last = (ord(name[i]) | 0x20 for i in (0, n // 2, n - 1))
+    return (n * a + first * b + middle * c + last) & (HEADER_SLOTS - 1)
+
+@task
+def headers():
+    '''Generates the header name recognizer: a perfect hash of the known
+    header names, by their length and first, middle and last characters,
+    with the smallest multipliers that leave no collision.'''
+    for a in range(1, HEADER_SLOTS):
+        for b in range(1, HEADER_SLOTS):
+            for c in range(1, HEADER_SLOTS):
+                slots = [header_hash(name, a, b, c) for name in HEADERS]
+                if len(set(slots)) == len(slots):
+                    break
+            else:
+                continue
+            break
+        else:
+            continue
+        break
+    else:
+        raise ValueError('no perfect hash for HEADERS')
+
+    ids = ['HEADER_' + name.upper().replace('-', '_') for name in HEADERS]
+    table = [0] * HEADER_SLOTS
+    for i, slot in enumerate(slots):
+        table[slot] = i + 1
+
+    def rows(values, width=12):
+        return ',\n'.join('    ' + ', '.join(values[i:i + width])
+                           for i in range(0, len(values), width))
+
+    lines = ['/**',
+             ' * Header names the parser recognizes. Generated by `shovel '
+             'headers` from',
+             ' * HEADERS in shovel.py, do not edit.',
+             ' *',
+             ' * A name is looked up by a perfect hash of its length and its '
+             'first, middle',
+             ' * and last characters, case folded, which gives the only '
+             'header it can be.',
+             ' */',
+             '',
+             '#ifndef HEADERS',
+             '#define HEADERS',
+             '',
+             '// constants',
+             '']
+    lines.append('#define %-28s%d' % ('HEADER_OTHER', 0))
+    for i, id in enumerate(ids):
+        lines.append('#define %-28s%d' % (id, i + 1))
+    lines.append('#define %-28s%d' % ('HEADER_COUNT', len(ids) + 1))
+    lines += ['',
+              '#define HEADER_MIN_LENGTH   %d' % min(map(len, HEADERS)),
+              '#define HEADER_MAX_LENGTH   %d' % max(map(len, HEADERS)),
+              '#define HEADER_SLOTS        %d' % HEADER_SLOTS,
+              '',
+              '#define header_hash(n, first, middle, last) \\',
+              '    (((n) * %d + (first) * %d + (middle) * %d + (last)) \\'
+              % (a, b, c),
+              '        & (HEADER_SLOTS - 1))',
+              '',
+              '// names and lengths, by HEADER_*',
+              '#define HEADER_NAMES { \\',
+              '    NULL, \\']
+    lines += ['    "%s", \\' % name for name in HEADERS]
+    lines += ['}',
+              '',
+              '#define HEADER_LENGTHS { \\',
+              rows(['0'] + [str(len(name)) for name in HEADERS])
+                  .replace('\n', ' \\\n') + ' \\',
+              '}',
+              '',
+              '// HEADER_* by hash',
+              '#define HEADER_TABLE { \\',
+              rows(['%2d' % id for id in table], 16)
+                  .replace('\n', ' \\\n') + ' \\',
+              '}',
+              '',
+              '#endif']
+    Path(HEADERS_FILE).write_text('\n'.join(lines) + '\n')
+
+@task
+def compile_bench():
+    try:
+        cmd = ['gcc', '-O2', '-o', str(Path(BENCH_EXE))]
+        cmd += [str(Path(src)) for src in BENCH_SRC]
+        cmd += ['-pthread']
         check_call(cmd)
     except CalledProcessError as e:
         print(e)
 
+def replay_requests(jsonl, raw):
+    '''Converts a JSON lines file to raw HTTP requests. Lines with a method
+    and a path are sent as such, with their headers and body; any other
+    line is posted as a JSON body.'''
+    with open(jsonl) as f, open(raw, 'wb') as out:
+        for i, line in enumerate(f):
+            if not line.strip():
+                continue
+            record = json.loads(line)
+            method = record.get('method', 'POST')
+            path = record.get('path', '/' + str(record.get('request_id', i)))
+            headers = record.get('headers', {})
+            body = record.get('body', line) if 'method' in record else line
+            body = body.encode()
+            head = '%s %s HTTP/1.1\r\nHost: localhost\r\n' % (method, path)
+            for name, value in headers.items():
+                head += '%s: %s\r\n' % (name, value)
+            if body:
+                head += 'Content-Length: %d\r\n' % len(body)
+            out.write(head.encode() + b'\r\n' + body)
+
+@task
+def bench(duration=5, workers=1, threads=2, output='bench_output.txt',
+        replay=None, uring=False):
+    '''Runs the standard benchmark matrix against a fresh server, writing
+    one JSON object per run to the output file, in a fixed order so
+    results can be diffed between commits, or between backends.'''
+    compile(uring=uring)
+    compile_bench()
+
+    runs = []
+    for connections in BENCH_CONNECTIONS:
+        for method, body in BENCH_SHAPES:
+            label = '%s-%d-c%d' % (method.lower(), body, connections)
+            runs.append((label, ['-c', str(connections), '-X', method,
+                                 '-b', str(body)]))
+    runs.append(('get-0-c64-pipeline', ['-c', '64', '-m', 'pipeline']))
+    runs.append(('get-0-c64-close', ['-c', '64', '-m', 'close']))
+
+    raw = None
+    if replay:
+        raw = NamedTemporaryFile(suffix='.http', delete=False).name
+        replay_requests(replay, raw)
+        runs.append(('replay-c64', ['-c', '64', '-f', raw]))
+
+    server = Popen([str(Path(EXE).absolute()), '-w', str(workers),
+                    BENCH_PORT])
+    try:
+        for _ in range(50):
+            try:
+                create_connection(('127.0.0.1', int(BENCH_PORT))).close()
+                break
+            except ConnectionRefusedError:
+                sleep(0.1)
+
+        with open(output, 'w') as out:
+            for label, args in runs:
+                cmd = [str(Path(BENCH_EXE).absolute()), '-j', '-l', label,
+                       '-d', str(duration), '-t', str(threads)] + args
+                result = check_output(cmd + ['127.0.0.1', BENCH_PORT])
+                out.write(result.decode())
+                print(result.decode(), end='')
+    finally:
+        server.send_signal(SIGINT)
+        server.wait()
+        if raw:
+            Path(raw).unlink()
+
+@task
+def bench_parser(iterations=100000):
+    '''Runs the parser microbenchmark.'''
+    try:
+        cmd = ['gcc', '-O2', '-o', str(Path(PARSER_BENCH_EXE))]
+        cmd += [str(Path(src)) for src in PARSER_SRC + PARSER_BENCH_SRC]
+        check_call(cmd)
+        check_call([str(Path(PARSER_BENCH_EXE).absolute()), str(iterations)])
+    except CalledProcessError as e:
+        print(e)
+
+@task
+def fuzz(standalone=False, *args):
+    '''Builds the parser fuzz target with libFuzzer and runs it, passing
+    any arguments on. With --standalone, it is built with gcc and runs on
+    random mutations of the corpus instead.'''
+    try:
+        src = [str(Path(src)) for src in PARSER_SRC + FUZZ_SRC]
+        if standalone:
+            cmd = ['gcc', '-D', 'FUZZ_STANDALONE']
+        else:
+            cmd = ['clang', '-fsanitize=fuzzer']
+        cmd += ['-g', '-O1', '-fsanitize=address,undefined']
+        check_call(cmd + ['-o', str(Path(FUZZ_EXE))] + src)
+        check_call([str(Path(FUZZ_EXE).absolute())] + list(args))
+    except CalledProcessError as e:
+        print(e)
+
 @task
 def clean():
     Path(EXE).unlink()
-
@@ -0,0 +1,215 @@
+/**
+ * Tests of the streaming body API of the parser, built and run by
+ * test_parser.py. Request bodies, fed from memory or read from a socket,
+ * are passed to a body handler that pauses every few fragments: every
+ * fragment must arrive once and in order, and nothing may be passed on
+ * or read from the socket while the body is paused.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "harness.h"
+
+// constants
+
+#define BODY_SIZE       (3 * BUFFER_SIZE + 100)
+#define CHUNK_LENGTH    1000
+#define REQUEST_SIZE    (2 * BODY_SIZE)
+
+
+// global state
+
+static char body[BODY_SIZE];
+
+// the body as passed to the handler
+static char received[BODY_SIZE];
+static int received_size;
+static int fragments;
+static int pause_every;
+
+
+// functions
+
+/**
+ * Outputs why a test failed. Returns FALSE.
+ */
+static int fail(const char test[], const char message[]) {
+    fprintf(stderr, "%s: %s\n", test, message);
+    return FALSE;
+}
+
+/**
+ * Body handler: keeps the fragment, pausing every _pause_every_ of them.
+ */
+static int collect_body(struct parser *p, const char data[], int n) {
+    if (received_size + n > BODY_SIZE)
+        n = BODY_SIZE - received_size;
+
+    memcpy(received + received_size, data, n);
+    received_size += n;
+    fragments++;
+    return fragments % pause_every != 0;
+}
+
+/**
+ * Starts a test with a parser that pauses every given number of
+ * fragments.
+ */
+static void start_test(struct parser *p, int pauses) {
+    init_parser(p);
+    set_body_handler(p, collect_body);
+    received_size = 0;
+    fragments = 0;
+    pause_every = pauses;
+}
+
+/**
+ * Checks that the whole body was received once the request is parsed.
+ */
+static int check_body(struct parser *p, const char test[]) {
+    if (p->state != PARSING_DONE)
+        return fail(test, "request not parsed");
+    if (received_size != BODY_SIZE || memcmp(received, body, BODY_SIZE) != 0)
+        return fail(test, "body not received in order");
+    if (fragments <= pause_every)
+        return fail(test, "body never paused");
+    return TRUE;
+}
+
+/**
+ * Writes a POST request with the test body, with Content-Length or in
+ * chunks. Returns its size.
+ */
+static int build_request(char dst[], int chunked) {
+    int i, k, n;
+
+    if (!chunked) {
+        n = sprintf(dst, "POST /upload HTTP/1.1\r\nContent-Length: %d\r\n"
+                "\r\n", BODY_SIZE);
+        memcpy(dst + n, body, BODY_SIZE);
+        return n + BODY_SIZE;
+    }
+
+    n = sprintf(dst, "POST /upload HTTP/1.1\r\n"
+            "Transfer-Encoding: chunked\r\n\r\n");
+    for (i = 0; i < BODY_SIZE; i += k) {
+        k = min(CHUNK_LENGTH, BODY_SIZE - i);
+        n += sprintf(dst + n, "%x\r\n", k);
+        memcpy(dst + n, body + i, k);
+        n += k;
+        n += sprintf(dst + n, "\r\n");
+    }
+    return n + sprintf(dst + n, "0\r\n\r\n");
+}
+
+/**
+ * Feeds a request _step_ bytes at a time, resuming the body after every
+ * other piece, so that some pieces arrive while it is paused.
+ */
+static int test_fed(int step, int chunked) {
+    static char data[REQUEST_SIZE];
+    const char *test;
+    struct parser p;
+    int i, k, n, passed;
+
+    test = chunked ? "fed chunked body" : "fed body";
+    n = build_request(data, chunked);
+    start_test(&p, 3);
+    for (i = 0; i < n && p.state != PARSING_ERROR; i += k) {
+        k = min(step, n - i);
+        passed = fragments;
+        if (p.paused) {
+            feed_parser(&p, data + i, k);
+            if (fragments != passed)
+                return fail(test, "fragment passed while paused");
+        } else {
+            feed_parser(&p, data + i, k);
+            if (p.paused && (i / step) % 2 == 0)
+                resume_body(&p);
+        }
+    }
+
+    while (p.paused && p.state != PARSING_ERROR)
+        resume_body(&p);
+
+    passed = check_body(&p, test);
+    free_parser(&p);
+    return passed;
+}
+
+/**
+ * Reads a request from a socket, pausing after every fragment. A paused
+ * parser must leave the rest of the request in the socket.
+ */
+static int test_socket(int chunked) {
+    static char data[REQUEST_SIZE];
+    const char *test;
+    struct parser p;
+    int fds[2], i, n, before, after, passed, taken;
+
+    test = chunked ? "socket chunked body" : "socket body";
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) != 0)
+        return fail(test, "no socket pair");
+
+    n = build_request(data, chunked);
+    if (write(fds[1], data, n) != n) {
+        close(fds[0]);
+        close(fds[1]);
+        return fail(test, "request not written");
+    }
+
+    start_test(&p, 1);
+    p.fd = fds[0];
+    passed = TRUE;
+
+    // every round takes in some of the request, unless it stalls
+    for (i = 0; passed && i < n && p.state != PARSING_DONE
+            && p.state != PARSING_ERROR; i++) {
+        parse_request(&p);
+        if (!p.paused)
+            continue;
+
+        // the first pause comes before the end of the request
+        ioctl(fds[0], FIONREAD, &before);
+        if (fragments == 1 && before == 0)
+            passed = fail(test, "whole request read before pausing");
+
+        taken = fragments;
+        parse_request(&p);
+        ioctl(fds[0], FIONREAD, &after);
+        if (after != before || fragments != taken)
+            passed = fail(test, "socket read while paused");
+        resume_body(&p);
+    }
+
+    passed = passed && check_body(&p, test);
+    free_parser(&p);
+    close(fds[0]);
+    close(fds[1]);
+    return passed;
+}
+
+int main(int argc, char** argv) {
+    static const int steps[] = { 1, 7, 100, BUFFER_SIZE, REQUEST_SIZE };
+    int chunked, i, passed;
+
+    if (!init_harness()) {
+        fputs("Could not set up the parser\n", stderr);
+        return 1;
+    }
+
+    for (i = 0; i < BODY_SIZE; i++)
+        body[i] = 'a' + i % 23;
+
+    passed = TRUE;
+    for (chunked = FALSE; chunked <= TRUE; chunked++) {
+        for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
+            passed = test_fed(steps[i], chunked) && passed;
+        passed = test_socket(chunked) && passed;
+    }
+
+    puts(passed ? "body streaming ok" : "body streaming failed");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+from pathlib import Path
+from subprocess import check_call, check_output
+
+def test_body_streaming(tmp_path):
+    src = ('arena.c', 'errors.c', 'util.c', 'scan.c', 'parser.c', 'harness.c',
+           'test_parser.c')
+    exe = tmp_path / 'test_parser'
+    check_call(['gcc', '-o', str(exe)] + [str(Path(f)) for f in src])
+    assert check_output([str(exe)]) == b'body streaming ok\n'
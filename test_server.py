@@ -1,4 +1,8 @@
+import socket
 import requests
+import select
+
+from time import monotonic, sleep
 
 def test_get(server):
     r = requests.get('http://' + server)
@@ -15,3 +19,419 @@ def test_post(server):
     assert r.status_code == 501
     assert r.content == b''
 
+
+def exchange(sock, data, n=1):
+    sock.sendall(data)
+    reply = b''
+    while reply.count(b'HTTP/1.') < n or not reply.endswith((b'world', b'\r\n\r\n')):
+        chunk = sock.recv(4096)
+        if not chunk:
+            break
+        reply += chunk
+    return reply
+
+def test_keep_alive(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        for _ in range(3):
+            r = exchange(s, b'GET / HTTP/1.1\r\nHost: test\r\n\r\n')
+            assert r.startswith(b'HTTP/1.1 200 OK\r\n')
+            assert b'Connection: close' not in r
+
+def test_connection_close(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'GET / HTTP/1.1\r\nConnection: close\r\n\r\n')
+        assert b'Connection: close\r\n' in r
+        assert s.recv(4096) == b''
+
+def test_pipelining(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n'
+                b'POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\ntest'
+                b'HEAD / HTTP/1.1\r\n\r\n', 3)
+        assert r.count(b'HTTP/1.1 200 OK\r\n') == 2
+        assert r.count(b'HTTP/1.1 501 Not Implemented\r\n') == 1
+        assert r.index(b'501') < r.rindex(b'200')
+
+def test_split_method(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        for part in (b'PG', b'ST / HTTP/1.1\r\n', b'\r\n'):
+            s.sendall(part)
+            sleep(0.05)
+        r = exchange(s, b'')
+        assert r.startswith(b'HTTP/1.1 501 Not Implemented\r\n')
+
+def test_large_body(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        s.sendall(b'POST / HTTP/1.1\r\nContent-Length: 4000000\r\n\r\n')
+        for _ in range(40):
+            s.sendall(b'x' * 100000)
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n', 2)
+        assert r.startswith(b'HTTP/1.1 501 Not Implemented\r\n')
+        assert r.endswith(b'hello world')
+
+def test_chunked_body(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        s.sendall(b'POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n')
+        for _ in range(40):
+            s.sendall(b'186a0\r\n' + b'x' * 100000 + b'\r\n')
+        s.sendall(b'0\r\nX-Trailer: yes\r\n\r\n')
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n', 2)
+        assert r.startswith(b'HTTP/1.1 501 Not Implemented\r\n')
+        assert r.endswith(b'hello world')
+
+def test_content_length_conflict(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'POST / HTTP/1.1\r\nContent-Length: 3\r\n'
+                     b'Content-Length: 3\r\n\r\nabcGET / HTTP/1.1\r\n\r\n', 2)
+        assert r.startswith(b'HTTP/1.1 501 Not Implemented\r\n')
+        assert r.endswith(b'hello world')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'POST / HTTP/1.1\r\nContent-Length: 0\r\n'
+                     b'Content-Length: 10\r\n\r\n')
+        assert r.startswith(b'HTTP/1.1 400 Bad Request\r\n')
+
+def test_route(server):
+    r = requests.get('http://' + server + '/health')
+    assert r.status_code == 200
+    assert r.content == b'ok'
+
+def test_headers(server):
+    r = requests.get('http://' + server)
+    assert r.headers['Server'] == 'cserver'
+    assert r.headers['X-Test'] == 'yes'
+    assert r.headers['Date'].endswith(' GMT')
+
+def read_until(sock, end):
+    reply = b''
+    while not reply.endswith(end):
+        chunk = sock.recv(4096)
+        if not chunk:
+            break
+        reply += chunk
+    return reply
+
+def test_metrics_chunked(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        s.sendall(b'GET /__metrics HTTP/1.1\r\n\r\n')
+        r = read_until(s, b'\r\n0\r\n\r\n')
+        head, body = r.split(b'\r\n\r\n', 1)
+        assert head.startswith(b'HTTP/1.1 200 OK\r\n')
+        assert b'\r\nTransfer-Encoding: chunked' in head
+        assert b'Content-Length' not in head
+
+        text = b''
+        while True:
+            size, body = body.split(b'\r\n', 1)
+            if int(size, 16) == 0:
+                break
+            text += body[:int(size, 16)]
+            assert body[int(size, 16):].startswith(b'\r\n')
+            body = body[int(size, 16) + 2:]
+        assert body == b'\r\n'
+        assert text.startswith(b'# TYPE cserver_connections_accepted_total')
+        assert b'cserver_phase_seconds_count{phase="write"} ' in text
+
+        # the connection is kept alive after the last chunk
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n')
+        assert r.endswith(b'hello world')
+
+def test_metrics_http_1_0(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        s.sendall(b'GET /__metrics HTTP/1.0\r\nConnection: keep-alive\r\n\r\n')
+        r = read_until(s, b'\0')
+        head, body = r.split(b'\r\n\r\n', 1)
+        assert head.startswith(b'HTTP/1.0 200 OK\r\n')
+        assert b'Transfer-Encoding' not in head
+        assert b'Content-Length' not in head
+        assert b'Connection: keep-alive' not in head
+        assert body.startswith(b'# TYPE cserver_connections_accepted_total')
+        assert body.endswith(b'\n')
+
+def test_metrics_head(server):
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'HEAD /__metrics HTTP/1.1\r\n\r\n')
+        assert r.startswith(b'HTTP/1.1 200 OK\r\n')
+        assert r.endswith(b'Transfer-Encoding: chunked\r\n\r\n')
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n')
+        assert r.startswith(b'HTTP/1.1 200 OK\r\n')
+        assert r.endswith(b'hello world')
+
+def test_metrics(server):
+    requests.get('http://' + server)
+    r = requests.get('http://' + server + '/__metrics')
+    assert r.status_code == 200
+    assert b'cserver_requests_total{method="GET"} ' in r.content
+    assert b'cserver_responses_total{status="200"} ' in r.content
+
+def hold_handlers(server, n):
+    '''Takes n handlers, with connections that never finish their request.'''
+    host, port = server.split(':')
+    held = []
+    for _ in range(n):
+        s = socket.create_connection((host, int(port)), timeout=5)
+        s.sendall(b'GET / HTTP/1.1\r\n')
+        held.append(s)
+        sleep(0.05)
+    return held
+
+def test_pause(custom_server):
+    server = custom_server('-n', '10', '-c', '/health')
+    host, port = server.split(':')
+    held = hold_handlers(server, 10)
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        s.sendall(b'GET /health HTTP/1.1\r\n\r\n')
+        s.settimeout(0.5)
+        try:
+            assert s.recv(4096) == b''
+        except socket.timeout:
+            pass
+
+        # accepted once a handler is released
+        held.pop().close()
+        s.settimeout(5)
+        r = exchange(s, b'')
+        assert r.startswith(b'HTTP/1.1 200 OK\r\n')
+        assert r.endswith(b'\r\n\r\nok')
+    for h in held:
+        h.close()
+
+def test_shed(custom_server):
+    server = custom_server('-n', '10', '-s')
+    host, port = server.split(':')
+    held = hold_handlers(server, 10)
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        s.sendall(b'GET / HTTP/1.1\r\n\r\n')
+        r = read_until(s, b'\0')
+        assert r.startswith(b'HTTP/1.1 503 Service Unavailable\r\n')
+        assert b'\r\nRetry-After: 1\r\n' in r
+    for h in held:
+        h.close()
+
+def test_reserved_handlers(custom_server):
+    server = custom_server('-n', '10', '-c', '/health')
+    host, port = server.split(':')
+
+    # the last 8 handlers are reserved for health checks
+    held = hold_handlers(server, 2)
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n')
+        assert r.startswith(b'HTTP/1.1 503 Service Unavailable\r\n')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'GET /health HTTP/1.1\r\n\r\n')
+        assert r.startswith(b'HTTP/1.1 200 OK\r\n')
+        assert r.endswith(b'\r\n\r\nok')
+    for h in held:
+        h.close()
+
+def file_server(custom_server, root):
+    '''Starts a server for a document root with an index and a text file.'''
+    (root / 'index.html').write_bytes(b'<p>index</p>')
+    (root / 'sub').mkdir()
+    (root / 'sub' / 'a.txt').write_bytes(b'0123456789')
+    return custom_server('-d', str(root))
+
+def test_file(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    r = requests.get('http://' + server + '/sub/a.txt')
+    assert r.status_code == 200
+    assert r.content == b'0123456789'
+    assert r.headers['Content-Type'] == 'text/plain; charset=utf-8'
+    assert r.headers['Content-Length'] == '10'
+    assert r.headers['ETag'].startswith('"')
+
+    # served from the cache the second time
+    r = requests.get('http://' + server + '/sub/a.txt')
+    assert r.content == b'0123456789'
+
+    # sent in several writes
+    data = bytes(range(256)) * 4096
+    (tmp_path / 'large.bin').write_bytes(data)
+    r = requests.get('http://' + server + '/large.bin')
+    assert r.headers['Content-Type'] == 'application/octet-stream'
+    assert r.content == data
+
+def test_file_index(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    r = requests.get('http://' + server + '/')
+    assert r.status_code == 200
+    assert r.content == b'<p>index</p>'
+    assert r.headers['Content-Type'] == 'text/html; charset=utf-8'
+
+def test_file_not_found(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    assert requests.get('http://' + server + '/missing.txt').status_code == 404
+    assert requests.get('http://' + server + '/sub').status_code == 404
+
+def test_file_traversal(custom_server, tmp_path):
+    root = tmp_path / 'root'
+    root.mkdir()
+    (tmp_path / 'secret.txt').write_bytes(b'secret')
+    server = file_server(custom_server, root)
+    host, port = server.split(':')
+
+    # sent as is, as clients would normalize the path
+    for path in (b'/../secret.txt', b'/sub/../../secret.txt', b'/sub/..'):
+        with socket.create_connection((host, int(port)), timeout=5) as s:
+            r = exchange(s, b'GET ' + path + b' HTTP/1.1\r\n\r\n')
+            assert r.startswith(b'HTTP/1.1 404 Not Found\r\n')
+            assert b'secret' not in r
+
+def test_file_head(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    r = requests.head('http://' + server + '/sub/a.txt')
+    assert r.status_code == 200
+    assert r.headers['Content-Length'] == '10'
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'HEAD /sub/a.txt HTTP/1.1\r\n\r\n')
+        assert r.endswith(b'\r\n\r\n')
+        s.settimeout(0.5)
+        try:
+            assert s.recv(4096) == b''
+        except socket.timeout:
+            pass
+
+def test_file_changed(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    r = requests.get('http://' + server + '/sub/a.txt')
+    assert r.content == b'0123456789'
+    etag = r.headers['ETag']
+
+    (tmp_path / 'sub' / 'a.txt').write_bytes(b'changed')
+    sleep(0.2)
+    r = requests.get('http://' + server + '/sub/a.txt')
+    assert r.content == b'changed'
+    assert r.headers['ETag'] != etag
+
+def test_file_not_modified(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    url = 'http://' + server + '/sub/a.txt'
+    r = requests.get(url)
+    etag, modified = r.headers['ETag'], r.headers['Last-Modified']
+
+    r = requests.get(url, headers={'If-None-Match': etag})
+    assert r.status_code == 304
+    assert r.content == b''
+    assert r.headers['ETag'] == etag
+    r = requests.get(url, headers={'If-None-Match': '"other", ' + etag})
+    assert r.status_code == 304
+    r = requests.get(url, headers={'If-None-Match': '"other"'})
+    assert r.status_code == 200
+
+    r = requests.get(url, headers={'If-Modified-Since': modified})
+    assert r.status_code == 304
+    r = requests.get(url, headers={'If-Modified-Since': 'Thu, 01 Jan 1970 00:00:00 GMT'})
+    assert r.status_code == 200
+
+    # If-None-Match takes precedence
+    r = requests.get(url, headers={'If-None-Match': '"other"', 'If-Modified-Since': modified})
+    assert r.status_code == 200
+
+def test_file_range(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    url = 'http://' + server + '/sub/a.txt'
+    r = requests.get(url, headers={'Range': 'bytes=2-5'})
+    assert r.status_code == 206
+    assert r.content == b'2345'
+    assert r.headers['Content-Range'] == 'bytes 2-5/10'
+    assert r.headers['Content-Length'] == '4'
+
+    r = requests.get(url, headers={'Range': 'bytes=7-'})
+    assert r.status_code == 206
+    assert r.content == b'789'
+    r = requests.get(url, headers={'Range': 'bytes=8-100'})
+    assert r.status_code == 206
+    assert r.content == b'89'
+    assert r.headers['Content-Range'] == 'bytes 8-9/10'
+
+    # the last bytes, or the whole file if shorter
+    r = requests.get(url, headers={'Range': 'bytes=-3'})
+    assert r.status_code == 206
+    assert r.content == b'789'
+    assert r.headers['Content-Range'] == 'bytes 7-9/10'
+    r = requests.get(url, headers={'Range': 'bytes=-20'})
+    assert r.status_code == 206
+    assert r.content == b'0123456789'
+
+    # several ranges get the whole file
+    r = requests.get(url, headers={'Range': 'bytes=0-1,4-5'})
+    assert r.status_code == 200
+    assert r.content == b'0123456789'
+
+def test_file_if_range(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    url = 'http://' + server + '/sub/a.txt'
+    r = requests.get(url)
+    etag, modified = r.headers['ETag'], r.headers['Last-Modified']
+
+    for validator in (etag, modified):
+        r = requests.get(url, headers={'Range': 'bytes=0-3', 'If-Range': validator})
+        assert r.status_code == 206
+        assert r.content == b'0123'
+
+    for validator in ('"other"', 'Thu, 01 Jan 1970 00:00:00 GMT'):
+        r = requests.get(url, headers={'Range': 'bytes=0-3', 'If-Range': validator})
+        assert r.status_code == 200
+        assert r.content == b'0123456789'
+
+def test_file_unsatisfiable(custom_server, tmp_path):
+    server = file_server(custom_server, tmp_path)
+    r = requests.get('http://' + server + '/sub/a.txt', headers={'Range': 'bytes=10-'})
+    assert r.status_code == 416
+    assert r.content == b''
+    assert r.headers['Content-Range'] == 'bytes */10'
+
+def test_idle_timeout(custom_server):
+    server = custom_server('-t', 'idle=1')
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        r = exchange(s, b'GET / HTTP/1.1\r\n\r\n')
+        assert r.startswith(b'HTTP/1.1 200 OK\r\n')
+        start = monotonic()
+        assert s.recv(4096) == b''
+        assert monotonic() - start < 4
+
+def test_header_timeout(custom_server):
+    server = custom_server('-t', 'head=1')
+    host, port = server.split(':')
+    with socket.create_connection((host, int(port)), timeout=5) as s:
+        # every byte makes progress, but the head never ends in time
+        start = monotonic()
+        try:
+            for c in b'GET / HTTP/1.1\r\nX-Slow: ' + b'x' * 100:
+                s.sendall(bytes([c]))
+                sleep(0.1)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+        assert s.recv(4096) == b''
+        assert monotonic() - start < 4
+
+def test_out_of_buffers(custom_server):
+    server = custom_server()
+    host, port = server.split(':')
+
+    # unfinished heads take every buffer chunk of the worker
+    held = []
+    reply = b''
+    for _ in range(1000):
+        s = socket.create_connection((host, int(port)), timeout=5)
+        s.sendall(b'GET / HTTP/1.1\r\nX-Long: ' + b'x' * 60000)
+        held.append(s)
+        ready, _, _ = select.select(held, [], [], 0.02)
+        if ready:
+            reply = read_until(ready[0], b'\r\n\r\n')
+            break
+    assert reply.startswith(b'HTTP/1.1 500 Internal Server Error\r\n')
+    assert b'Connection: close\r\n' in reply
+    for s in held:
+        s.close()
@@ -0,0 +1,95 @@
+#include <time.h>
+
+#include "timer.h"
+
+
+// functions
+
+/**
+ * Gets the current time in seconds, from a monotonic clock.
+ */
+static long now_seconds(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec;
+}
+
+/**
+ * Links a timeout into the slot of its deadline.
+ */
+static void link_timeout(struct timer_wheel *w, struct timeout *t) {
+    struct timeout *slot;
+
+    slot = &(w->slots[t->deadline % TIMER_SLOTS]);
+    t->prev = slot;
+    t->next = slot->next;
+    slot->next->prev = t;
+    slot->next = t;
+}
+
+
+// see header file
+void init_timer_wheel(struct timer_wheel *w) {
+    int i;
+
+    for (i = 0; i < TIMER_SLOTS; i++) {
+        w->slots[i].prev = &(w->slots[i]);
+        w->slots[i].next = &(w->slots[i]);
+        w->slots[i].deadline = 0;
+    }
+    w->now = now_seconds();
+}
+
+void init_timeout(struct timeout *t) {
+    t->prev = NULL;
+    t->next = NULL;
+    t->deadline = 0;
+}
+
+void set_timeout(struct timer_wheel *w, struct timeout *t, int seconds) {
+    long deadline;
+
+    // the wheel may be up to a second behind, so round up
+    deadline = w->now + seconds + 1;
+    if (t->next != NULL && t->deadline == deadline)
+        return;
+
+    clear_timeout(t);
+    t->deadline = deadline;
+    link_timeout(w, t);
+}
+
+void clear_timeout(struct timeout *t) {
+    if (t->next == NULL)
+        return;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = NULL;
+    t->next = NULL;
+}
+
+void advance_timer_wheel(struct timer_wheel *w,
+        void (*expire)(struct timeout*, void*), void *data) {
+    struct timeout *slot, *t, *next;
+    long now;
+
+    // after a long stall, every slot is checked once
+    now = now_seconds();
+    if (now - w->now > TIMER_SLOTS)
+        w->now = now - TIMER_SLOTS;
+
+    while (w->now < now) {
+        w->now++;
+        slot = &(w->slots[w->now % TIMER_SLOTS]);
+        for (t = slot->next; t != slot; t = next) {
+            next = t->next;
+            if (t->deadline > w->now)
+                continue;
+
+            clear_timeout(t);
+            expire(t, data);
+        }
+    }
+}
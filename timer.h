@@ -0,0 +1,61 @@
+/**
+ * Hashed timer wheel for connection timeouts, with one second resolution.
+ * Timeouts are linked into the slot of their deadline, so setting,
+ * moving and clearing them takes constant time, and each tick only looks
+ * at the slot of the current second.
+ */
+
+#ifndef TIMER
+#define TIMER
+
+#include "config.h"
+
+
+// data types
+
+/**
+ * A timeout, embedded in whatever it applies to.
+ */
+struct timeout {
+    struct timeout *prev;
+    struct timeout *next;
+    long deadline;
+};
+
+struct timer_wheel {
+    struct timeout slots[TIMER_SLOTS];
+    long now;
+};
+
+
+// functions
+
+/**
+ * Initializes an empty wheel, starting at the current time.
+ */
+void init_timer_wheel(struct timer_wheel*);
+
+/**
+ * Initializes an inactive timeout.
+ */
+void init_timeout(struct timeout*);
+
+/**
+ * Sets (or moves) a timeout to expire in the given number of seconds.
+ */
+void set_timeout(struct timer_wheel*, struct timeout*, int);
+
+/**
+ * Cancels a timeout. Does nothing if it is not active.
+ */
+void clear_timeout(struct timeout*);
+
+/**
+ * Advances the wheel to the current time, calling the given function for
+ * each expired timeout, with the last argument. The timeouts are cleared
+ * before the function is called.
+ */
+void advance_timer_wheel(struct timer_wheel*,
+        void (*)(struct timeout*, void*), void*);
+
+#endif
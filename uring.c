@@ -0,0 +1,847 @@
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+
+// constants
+
+// handlers are cache line aligned, so their low bits are free
+#define OP_MASK     15
+#define OP_ACCEPT   1
+#define OP_RECV     2
+#define OP_SEND     3
+#define OP_CLOSE    4
+#define OP_CANCEL   5
+#define OP_STOP     6
+#define OP_DATE     7
+#define OP_POLL     8
+#define OP_FILES    9
+
+#define BUFFER_GROUP 0
+
+// whether a handler is receiving
+#define RECV_OFF        0
+#define RECV_ON         1
+#define RECV_CANCELED   2
+
+
+// macros
+
+#define op_data(h, op) ((uint64_t) (uintptr_t) (h) | (op))
+#define op_handler(data) ((struct handler*) (uintptr_t) ((data) & ~OP_MASK))
+#define op_type(data) ((int) ((data) & OP_MASK))
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+// request data buffered and not parsed yet
+#define buffered(p) ((p)->buffer.size - (p)->mark)
+
+
+// ring functions
+
+/**
+ * Calls io_uring_enter(2), retrying if interrupted. Returns what it does.
+ */
+static int enter_ring(struct uring *u, unsigned submit, unsigned wait) {
+    int r;
+
+    do {
+        r = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+/**
+ * Submits the queued entries, and waits for the given number of
+ * completions.
+ */
+static void submit_ring(struct uring *u, unsigned wait) {
+    unsigned n;
+
+    n = u->sq_pending - *(u->sq_tail);
+    store_release(u->sq_tail, u->sq_pending);
+    if (n > 0 || wait > 0)
+        enter_ring(u, n, wait);
+}
+
+/**
+ * Makes room for the given number of entries in the submission queue,
+ * submitting it if need be.
+ */
+static void reserve_sqes(struct uring *u, unsigned n) {
+    if (u->sq_entries - (u->sq_pending - load_acquire(u->sq_head)) < n)
+        submit_ring(u, 0);
+}
+
+/**
+ * Gets a cleared submission queue entry, submitting the queue first if it
+ * is full.
+ */
+static struct io_uring_sqe* get_sqe(struct uring *u) {
+    struct io_uring_sqe *sqe;
+
+    reserve_sqes(u, 1);
+
+    sqe = &(u->sqes[u->sq_pending & u->sq_mask]);
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_pending++;
+    return sqe;
+}
+
+/**
+ * Gets an entry for an operation on a file descriptor, on behalf of a
+ * handler or of the worker (NULL).
+ */
+static struct io_uring_sqe* prep_op(struct uring *u, int opcode, int fd,
+        struct handler *h, int op) {
+    struct io_uring_sqe *sqe;
+
+    sqe = get_sqe(u);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = op_data(h, op);
+    return sqe;
+}
+
+/**
+ * Gives a buffer back to the ring receives take from.
+ */
+static void add_buffer(struct uring *u, int id) {
+    struct io_uring_buf *b;
+
+    b = &(u->buffer_ring->bufs[u->buffer_tail & (URING_BUFFERS - 1)]);
+    b->addr = (uint64_t) (uintptr_t) (u->buffers + id * BUFFER_SIZE);
+    b->len = BUFFER_SIZE;
+    b->bid = id;
+    u->buffer_tail++;
+    store_release(&(u->buffer_ring->tail), u->buffer_tail);
+}
+
+
+// submissions
+
+static void submit_accept(struct uring *u, int fd) {
+    struct io_uring_sqe *sqe;
+
+    // the socket must not block when shed
+    sqe = prep_op(u, IORING_OP_ACCEPT, fd, NULL, OP_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    u->accepting = TRUE;
+}
+
+static void submit_cancel(struct uring *u, uint64_t data) {
+    struct io_uring_sqe *sqe;
+
+    sqe = prep_op(u, IORING_OP_ASYNC_CANCEL, -1, NULL, OP_CANCEL);
+    sqe->addr = data;
+}
+
+static void submit_stop(struct uring *u) {
+    struct io_uring_sqe *sqe;
+
+    sqe = prep_op(u, IORING_OP_READ, u->stop_fd, NULL, OP_STOP);
+    sqe->addr = (uint64_t) (uintptr_t) &(u->stop_value);
+    sqe->len = sizeof(u->stop_value);
+}
+
+/**
+ * Waits one second to refresh the Date header.
+ */
+static void submit_date(struct uring *u) {
+    struct io_uring_sqe *sqe;
+
+    sqe = prep_op(u, IORING_OP_TIMEOUT, -1, NULL, OP_DATE);
+    sqe->addr = (uint64_t) (uintptr_t) &(u->date_timeout);
+    sqe->len = 1;
+}
+
+/**
+ * Waits for changes of the cached files.
+ */
+static void submit_files(struct uring *u, int fd) {
+    struct io_uring_sqe *sqe;
+
+    sqe = prep_op(u, IORING_OP_POLL_ADD, fd, NULL, OP_FILES);
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/**
+ * Starts receiving data for the handler, into provided buffers.
+ */
+static void submit_recv(struct uring *u, struct handler *h) {
+    struct io_uring_sqe *sqe;
+
+    sqe = prep_op(u, IORING_OP_RECV, h->fd, h, OP_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+
+    h->pending++;
+    h->receiving = RECV_ON;
+}
+
+/**
+ * Receives data for the handler as long as there is room for it: not
+ * while the request body is paused, nor past a request head ahead of the
+ * request being served. Data received until the receive is canceled is
+ * still buffered.
+ */
+static void update_recv(struct uring *u, struct handler *h) {
+    struct parser *p;
+    int room;
+
+    p = &(h->parser);
+    if (h->state == ST_DONE || p->closed)
+        return;
+
+    room = !p->paused && buffered(p) < MAX_REQUEST_HEAD;
+    if (room && h->receiving == RECV_OFF) {
+        submit_recv(u, h);
+    } else if (!room && h->receiving == RECV_ON) {
+        submit_cancel(u, op_data(h, OP_RECV));
+        h->receiving = RECV_CANCELED;
+    }
+}
+
+/**
+ * Closes the connection. The handler is released once every operation
+ * still in flight for it completes (see release_handler).
+ */
+static void close_handler(struct uring *u, struct handler *h) {
+    if (h->receiving == RECV_ON)
+        submit_cancel(u, op_data(h, OP_RECV));
+
+    clear_timeout(&(h->timeout));
+    prep_op(u, IORING_OP_CLOSE, h->fd, h, OP_CLOSE);
+    h->pending++;
+
+    h->state = ST_DONE;
+    debug("client disconnected");
+}
+
+/**
+ * Sends the rest of the queued responses, gathered with sendmsg(2). With
+ * MSG_WAITALL the kernel sends them in full, unless the connection fails.
+ * If the connection is not kept alive, and nothing follows the queued
+ * parts, its close is linked to the send, which only runs once it is
+ * complete. The handler keeps its timeout until then, in case the peer
+ * stops reading.
+ */
+static void submit_send(struct uring *u, struct handler *h) {
+    struct io_uring_sqe *sqe;
+    struct response *r;
+
+    r = &(h->response);
+    memset(&(h->message), 0, sizeof(h->message));
+    h->message.msg_iov = &(r->parts[r->current]);
+    h->message.msg_iovlen = r->count - r->current;
+
+    // a link must not be split between two submissions
+    reserve_sqes(u, 2);
+    sqe = prep_op(u, IORING_OP_SENDMSG, h->fd, h, OP_SEND);
+    sqe->addr = (uint64_t) (uintptr_t) &(h->message);
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    h->pending++;
+
+    if (h->keep_alive || file_pending(r) || r->stream != NULL)
+        return;
+
+    sqe->flags = IOSQE_IO_LINK;
+    prep_op(u, IORING_OP_CLOSE, h->fd, h, OP_CLOSE);
+    h->pending++;
+
+    if (h->receiving == RECV_ON)
+        submit_cancel(u, op_data(h, OP_RECV));
+    h->state = ST_DONE;
+    debug("client disconnected");
+}
+
+/**
+ * Sends what the socket takes of the response file, then waits for it to
+ * be writable again if some is left. There is no io_uring counterpart of
+ * sendfile(2), so it is called directly, on the non-blocking socket.
+ * Returns FALSE on errors.
+ */
+static int submit_file(struct uring *u, struct handler *h) {
+    struct io_uring_sqe *sqe;
+
+    if (!send_file(h))
+        return FALSE;
+
+    if (file_pending(&(h->response))) {
+        sqe = prep_op(u, IORING_OP_POLL_ADD, h->fd, h, OP_POLL);
+        sqe->poll32_events = POLLOUT;
+        h->pending++;
+    }
+    return TRUE;
+}
+
+/**
+ * Releases the handler if it is closed and has nothing in flight.
+ */
+static void release_handler(struct handler *h) {
+    if (h->state != ST_DONE || h->pending > 0)
+        return;
+
+    free_parser(&(h->parser));
+    free_handler(h);
+}
+
+/**
+ * Builds responses for the complete requests already parsed, as
+ * serve_requests does for the libev backend, and starts sending them.
+ */
+static void serve_requests(struct uring *u, struct handler *h) {
+    struct parser *p;
+    int n;
+
+    p = &(h->parser);
+    for (n = 0; p->state == PARSING_DONE || p->state == PARSING_ERROR;) {
+        debug("request processed");
+
+        if (!build_response(h)) {
+            log_error(h->error, 0, h->fd);
+            close_handler(u, h);
+            return;
+        }
+
+        n++;
+        if (!h->keep_alive || n >= MAX_PIPELINE || h->response.file != NULL
+                || h->response.stream != NULL)
+            break;
+
+        h->requests++;
+        reset_parser(p);
+        parse_buffered(p);
+    }
+
+    if (n == 0) {
+        if (p->closed)
+            close_handler(u, h);
+        else
+            update_timeout(h);
+        return;
+    }
+
+    h->state = ST_WRITING;
+    update_timeout(h);
+    submit_send(u, h);
+}
+
+/**
+ * Starts serving an accepted connection.
+ */
+static void start_handler(struct uring *u, struct handler *h, int fd) {
+    debug("client connected");
+
+    h->state = ST_READING;
+    h->error = E_NONE;
+    h->parser.fd = fd;
+    h->fd = fd;
+    h->pending = 0;
+    h->receiving = RECV_OFF;
+
+    // the request is usually there already, and taken right away by the
+    // receive (see set_defer_accept)
+    update_timeout(h);
+    submit_recv(u, h);
+}
+
+/**
+ * Stops accepting connections until a handler is released.
+ */
+static void pause_accept(struct uring *u, struct server *server) {
+    if (server->paused)
+        return;
+
+    debug("out of handlers, pausing");
+    submit_cancel(u, op_data(NULL, OP_ACCEPT));
+    server->paused = TRUE;
+}
+
+
+// completion handlers
+
+/**
+ * Takes an accepted connection. Connections accepted before a pause takes
+ * effect are parked until a handler is released, or shed if too many.
+ */
+static void accept_done(struct worker *w, struct io_uring_cqe *cqe) {
+    struct server *server;
+    struct uring *u;
+    struct handler *h;
+
+    server = &(w->server);
+    u = &(w->uring);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        u->accepting = FALSE;
+        if (!server->paused)
+            submit_accept(u, server->socket);
+    }
+
+    if (cqe->res < 0)
+        return;
+
+    count(server->metrics.accepted, 1);
+    h = new_handler(server);
+    if (h == NULL && (server->shed || u->parked_count == ACCEPT_BATCH)) {
+        debug("out of handlers, shedding");
+        shed_connection(server, cqe->res);
+        return;
+    } else if (h == NULL) {
+        u->parked[u->parked_count++] = cqe->res;
+        pause_accept(u, server);
+        return;
+    }
+
+    start_handler(u, h, cqe->res);
+    if (server->handler_pool == NULL && !server->shed)
+        pause_accept(u, server);
+}
+
+/**
+ * Drops a connection whose timeout expired. Shutting the socket down ends
+ * any receive or send still in flight, and with it any close linked to a
+ * send.
+ */
+static void expire_done(struct timeout *t, void *u) {
+    struct handler *h;
+
+    debug("connection timed out");
+    h = timeout_handler(t);
+    shutdown(h->fd, SHUT_RDWR);
+    if (h->state != ST_DONE)
+        close_handler((struct uring*) u, h);
+}
+
+static void recv_done(struct uring *u, struct handler *h,
+        struct io_uring_cqe *cqe) {
+    struct parser *p;
+    int id;
+
+    p = &(h->parser);
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        h->pending--;
+        h->receiving = RECV_OFF;
+    }
+
+    // copy the data and give the buffer back to the ring
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (h->state != ST_DONE && cqe->res > 0) {
+            count(h->pool->metrics.received, cqe->res);
+            if (p->state != PARSING_ERROR)
+                receive_data(p, u->buffers + id * BUFFER_SIZE, cqe->res);
+        }
+        add_buffer(u, id);
+    }
+
+    if (h->state == ST_DONE) {
+        release_handler(h);
+        return;
+    }
+
+    // out of buffers or canceled, the receive is submitted again if need
+    // be, and read errors are answered like parse errors
+    if (cqe->res == 0) {
+        debug("connection closed by peer");
+        p->closed = TRUE;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS
+            && cqe->res != -ECANCELED) {
+        if (h->state == ST_READING && p->state != PARSING_ERROR) {
+            p->state = PARSING_ERROR;
+            p->error = E_READ;
+            p->code = -cqe->res;
+        }
+        p->closed = TRUE;
+    }
+
+    if (h->state == ST_READING) {
+        note_read(h, now_ns());
+        if (p->state != PARSING_DONE && p->state != PARSING_ERROR)
+            parse_buffered(p);
+
+        // the body handler cannot take more for now
+        if (p->paused)
+            update_timeout(h);
+        else
+            serve_requests(u, h);
+    }
+
+    update_recv(u, h);
+    release_handler(h);
+}
+
+/**
+ * Serves the next request on the same connection, once the response is
+ * written.
+ */
+static void response_done(struct uring *u, struct handler *h) {
+    note_written(h);
+    debug("response written");
+
+    if (!h->keep_alive) {
+        close_handler(u, h);
+        release_handler(h);
+        return;
+    }
+
+    h->requests++;
+    h->state = ST_READING;
+    clear_response(&(h->response));
+
+    reset_parser(&(h->parser));
+    parse_buffered(&(h->parser));
+    serve_requests(u, h);
+
+    update_recv(u, h);
+    release_handler(h);
+}
+
+/**
+ * Fails the connection on a write error.
+ */
+static void write_failed(struct uring *u, struct handler *h, int code) {
+    log_error(E_WRITE, code, h->fd);
+    count(h->pool->metrics.errors[E_WRITE], 1);
+    if (h->state != ST_DONE)
+        close_handler(u, h);
+    release_handler(h);
+}
+
+/**
+ * Sends more of a file body, once the socket is writable (or right after
+ * the response head, without a completion).
+ */
+static void file_done(struct uring *u, struct handler *h,
+        struct io_uring_cqe *cqe) {
+    if (cqe != NULL) {
+        h->pending--;
+        if (h->state == ST_DONE) {
+            release_handler(h);
+            return;
+        }
+    }
+
+    if (cqe != NULL && cqe->res < 0) {
+        write_failed(u, h, -cqe->res);
+        return;
+    } else if (!submit_file(u, h)) {
+        write_failed(u, h, errno);
+        return;
+    }
+
+    if (file_pending(&(h->response)))
+        update_timeout(h);
+    else
+        response_done(u, h);
+}
+
+static void send_done(struct uring *u, struct handler *h,
+        struct io_uring_cqe *cqe) {
+    struct response *r;
+
+    h->pending--;
+    r = &(h->response);
+    if (cqe->res < 0) {
+        write_failed(u, h, -cqe->res);
+        return;
+    }
+
+    count(h->pool->metrics.sent, cqe->res);
+    advance_response(r, cqe->res);
+
+    // the linked close follows, unless the send was cut short
+    if (h->state == ST_DONE) {
+        if (r->mark == r->size)
+            note_written(h);
+        release_handler(h);
+        return;
+    }
+
+    if (r->mark < r->size) {
+        update_timeout(h);
+        submit_send(u, h);
+        return;
+    }
+
+    // a streamed body is produced as the queue is sent
+    if (r->stream != NULL && !continue_stream(h)) {
+        log_error(E_MEMORY, 0, h->fd);
+        close_handler(u, h);
+        release_handler(h);
+        return;
+    } else if (r->mark < r->size) {
+        update_timeout(h);
+        submit_send(u, h);
+        return;
+    }
+
+    if (file_pending(r))
+        file_done(u, h, NULL);
+    else
+        response_done(u, h);
+}
+
+static void close_done(struct uring *u, struct handler *h,
+        struct io_uring_cqe *cqe) {
+    // the linked send failed, close on its own
+    if (cqe->res == -ECANCELED) {
+        prep_op(u, IORING_OP_CLOSE, h->fd, h, OP_CLOSE);
+        return;
+    }
+
+    h->pending--;
+    release_handler(h);
+}
+
+/**
+ * Serves the connections parked while out of handlers, then accepts new
+ * ones again, once the canceled accept is over.
+ */
+static void resume_accept(struct uring *u, struct server *server) {
+    struct handler *h;
+    int i;
+
+    for (i = 0; i < u->parked_count; i++) {
+        h = new_handler(server);
+        if (h == NULL)
+            break;
+        start_handler(u, h, u->parked[i]);
+    }
+
+    u->parked_count -= i;
+    memmove(u->parked, u->parked + i, u->parked_count * sizeof(int));
+    if (u->parked_count > 0 || server->handler_pool == NULL || u->accepting)
+        return;
+
+    debug("accepting connections again");
+    server->paused = FALSE;
+    submit_accept(u, server->socket);
+}
+
+
+// see header file
+void resume_reading(struct handler *h) {
+    struct uring *u;
+
+    resume_body(&(h->parser));
+    if (h->parser.paused)
+        return;
+
+    u = &(server_worker(h->pool)->uring);
+    if (h->state == ST_READING)
+        serve_requests(u, h);
+    update_recv(u, h);
+}
+
+int init_uring(struct worker *w) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    struct uring *u;
+    size_t size;
+    char *ring;
+    unsigned *array;
+    int i, r;
+
+    u = &(w->uring);
+    memset(u, 0, sizeof(*u));
+    u->ring = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->stop_fd = -1;
+    u->date_timeout.tv_sec = 1;
+
+    // the ring is bound to the worker thread once it starts, which lets
+    // the kernel run completions on that thread only when it waits
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SINGLE_ISSUER
+            | IORING_SETUP_DEFER_TASKRUN;
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_R_DISABLED;
+        u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (u->fd < 0) {
+        error(E_URING, errno);
+        return FALSE;
+    } else if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        error(E_URING, ENOSYS);
+        free_uring(w);
+        return FALSE;
+    }
+
+    // both queues share a single mapping
+
+    u->sq_entries = params.sq_entries;
+    u->ring_size = max(params.sq_off.array
+            + params.sq_entries * sizeof(unsigned),
+            params.cq_off.cqes
+            + params.cq_entries * sizeof(struct io_uring_cqe));
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+            IORING_OFF_SQES);
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        error(E_URING, errno);
+        free_uring(w);
+        return FALSE;
+    }
+
+    ring = (char*) u->ring;
+    u->sq_head = (unsigned*) (ring + params.sq_off.head);
+    u->sq_tail = (unsigned*) (ring + params.sq_off.tail);
+    u->sq_mask = *(unsigned*) (ring + params.sq_off.ring_mask);
+    u->sq_pending = *(u->sq_tail);
+    u->cq_head = (unsigned*) (ring + params.cq_off.head);
+    u->cq_tail = (unsigned*) (ring + params.cq_off.tail);
+    u->cq_mask = *(unsigned*) (ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (ring + params.cq_off.cqes);
+
+    // entries are always submitted in order
+    array = (unsigned*) (ring + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    // provided buffers for receives
+
+    size = URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->buffers = (char*) malloc(URING_BUFFERS * BUFFER_SIZE);
+    if (posix_memalign((void**) &(u->buffer_ring), sysconf(_SC_PAGESIZE),
+            size) != 0 || u->buffers == NULL) {
+        u->buffer_ring = NULL;
+        error(E_URING, ENOMEM);
+        free_uring(w);
+        return FALSE;
+    }
+
+    memset(u->buffer_ring, 0, size);
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->buffer_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = BUFFER_GROUP;
+    r = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+            &reg, 1);
+    if (r < 0) {
+        error(E_URING, errno);
+        free(u->buffer_ring);
+        u->buffer_ring = NULL;
+        free_uring(w);
+        return FALSE;
+    }
+
+    for (i = 0; i < URING_BUFFERS; i++)
+        add_buffer(u, i);
+
+    u->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (u->stop_fd < 0) {
+        error(E_URING, errno);
+        free_uring(w);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void run_uring(struct worker *w) {
+    struct io_uring_cqe *cqe;
+    struct uring *u;
+    struct handler *h;
+    unsigned head, tail;
+
+    u = &(w->uring);
+    syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_ENABLE_RINGS,
+            NULL, 0);
+    u->running = TRUE;
+
+    submit_accept(u, w->server.socket);
+    submit_stop(u);
+    submit_date(u);
+    if (w->server.files.notify >= 0)
+        submit_files(u, w->server.files.notify);
+
+    // the accept holds the server socket open, so it must be over before
+    // the socket is closed
+    while (u->running || u->accepting) {
+        submit_ring(u, 1);
+
+        head = *(u->cq_head);
+        tail = load_acquire(u->cq_tail);
+        for (; head != tail; head++) {
+            cqe = &(u->cqes[head & u->cq_mask]);
+            h = op_handler(cqe->user_data);
+
+            switch (op_type(cqe->user_data)) {
+            case OP_ACCEPT:
+                accept_done(w, cqe);
+                break;
+
+            case OP_RECV:
+                recv_done(u, h, cqe);
+                break;
+
+            case OP_SEND:
+                send_done(u, h, cqe);
+                break;
+
+            case OP_POLL:
+                file_done(u, h, cqe);
+                break;
+
+            case OP_CLOSE:
+                close_done(u, h, cqe);
+                break;
+
+            case OP_DATE:
+                update_date();
+                advance_timer_wheel(&(w->server.timers), expire_done, u);
+                submit_date(u);
+                break;
+
+            case OP_FILES:
+                update_file_cache(&(w->server.files));
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    submit_files(u, w->server.files.notify);
+                break;
+
+            case OP_STOP:
+                u->running = FALSE;
+                w->server.paused = TRUE;
+                if (u->accepting)
+                    submit_cancel(u, op_data(NULL, OP_ACCEPT));
+                break;
+            }
+        }
+        store_release(u->cq_head, head);
+
+        if (w->server.paused && u->running)
+            resume_accept(u, &(w->server));
+    }
+}
+
+void stop_uring(struct worker *w) {
+    eventfd_write(w->uring.stop_fd, 1);
+}
+
+void free_uring(struct worker *w) {
+    struct uring *u;
+
+    // closing the ring cancels whatever is still in flight
+    u = &(w->uring);
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    if (u->ring != MAP_FAILED)
+        munmap(u->ring, u->ring_size);
+    close(u->fd);
+    if (u->stop_fd >= 0)
+        close(u->stop_fd);
+    free(u->buffer_ring);
+    free(u->buffers);
+}
@@ -0,0 +1,85 @@
+/**
+ * io_uring I/O backend, selected at compile time with -D URING. It drives
+ * the same parser and response logic as the libev callbacks, but with
+ * completion based I/O: multishot accept, multishot receives into a
+ * provided buffer ring, and sends linked to the close of the connection.
+ * Each loop iteration takes a single system call, whatever the number of
+ * connections served.
+ *
+ * The ring is driven with the raw system calls, io_uring_setup(2),
+ * io_uring_enter(2) and io_uring_register(2), so there is nothing to link
+ * against. Linux 6.0 or later is needed for multishot receives.
+ */
+
+#ifndef URING_BACKEND
+#define URING_BACKEND
+
+#include <linux/io_uring.h>
+
+#include "config.h"
+
+
+// data types
+
+/**
+ * Per worker io_uring state: the mapped rings, with the submission queue
+ * entries filled but not yet submitted from _sq_tail_ to _sq_pending_,
+ * and the ring of buffers receives take from. Connections accepted while
+ * out of handlers are _parked_ until one is released.
+ */
+struct uring {
+    int fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;
+    struct io_uring_cqe *cqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+
+    struct io_uring_buf_ring *buffer_ring;
+    unsigned short buffer_tail;
+    char *buffers;
+
+    struct __kernel_timespec date_timeout;
+    unsigned long long stop_value;
+    int stop_fd;
+    int running;
+    int accepting;
+    int parked[ACCEPT_BATCH];
+    int parked_count;
+};
+
+struct worker;
+
+
+// functions
+
+/**
+ * Sets up the ring and its buffers for the given worker, whose server
+ * socket must already be open. Returns FALSE on failure.
+ */
+int init_uring(struct worker*);
+
+/**
+ * Runs the worker loop until stopped. Must be called on the worker
+ * thread, which the ring is then bound to.
+ */
+void run_uring(struct worker*);
+
+/**
+ * Asks the worker loop to stop. Can be called from any thread.
+ */
+void stop_uring(struct worker*);
+
+/**
+ * Releases the ring and its buffers.
+ */
+void free_uring(struct worker*);
+
+#endif
@@ -2,84 +2,165 @@
 #include "util.h"
 
 
+// macros
+
+// the pool size is read by the metrics of other threads
+#define add_pool_size(n) __atomic_store_n(&(chunk_pool.size), \
+        chunk_pool.size + (n), __ATOMIC_RELAXED)
+
+
+// global state
+
+__thread struct chunk_pool chunk_pool;
+
+
 // see header file
+int init_chunk_pool(struct arena *a, int n) {
+    struct chunk *c;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        c = (struct chunk*) arena_alloc(a, CHUNK_SIZE);
+        if (c == NULL)
+            return FALSE;
+
+        // the data starts on its own cache line
+        c->data = (char*) c + CACHE_LINE_SIZE;
+        c->capacity = BUFFER_SIZE;
+        c->next = chunk_pool.pool;
+        chunk_pool.pool = c;
+        add_pool_size(1);
+    }
+    return TRUE;
+}
+
 void init_buffer(struct buffer *b) {
     b->head = NULL;
     b->tail = NULL;
+    b->cursor = NULL;
+    b->cstart = 0;
     b->size = 0;
     b->tsize = 0;
+    b->own.next = NULL;
+    b->own.data = NULL;
+    b->own.capacity = 0;
+}
+
+void buffer_set_inline(struct buffer *b, char data[], int n) {
+    b->own.data = data;
+    b->own.capacity = n;
+}
+
+/**
+ * Releases a chunk of the buffer, returning it to the pool unless it is
+ * the inline one.
+ */
+void free_chunk(struct buffer *b, struct chunk *c) {
+    if (c == &(b->own))
+        return;
+
+    c->next = chunk_pool.pool;
+    chunk_pool.pool = c;
+    add_pool_size(1);
 }
 
 void clear_buffer(struct buffer *b) {
     struct chunk *c;
 
     b->tail = NULL;
+    b->cursor = NULL;
+    b->cstart = 0;
+    b->size = 0;
+    b->tsize = 0;
     while (b->head != NULL) {
         c = b->head;
         b->head = b->head->next;
-
-        if (chunk_pool.size < MAX_BUFFERS) {
-            c->next = chunk_pool.pool;
-            chunk_pool.pool = c;
-            chunk_pool.size++;
-        } else
-            free(c);
+        free_chunk(b, c);
     }
 }
 
-struct chunk* new_chunk() {
+/**
+ * Takes a new chunk for the buffer: the inline one if the buffer is empty
+ * and has one, otherwise one from the pool. Returns NULL if the pool is
+ * empty.
+ */
+struct chunk* new_chunk(struct buffer *b) {
     struct chunk *p;
 
-    if (chunk_pool.pool != NULL) {
+    if (b->head == NULL && b->own.capacity > 0) {
+        p = &(b->own);
+    } else {
         p = chunk_pool.pool;
+        if (p == NULL)
+            return NULL;
+
         chunk_pool.pool = p->next;
-        chunk_pool.size--;
-    } else
-        p = (struct chunk*) malloc(sizeof(struct chunk));
+        add_pool_size(-1);
+    }
 
     p->next = NULL;
     return p;
 }
 
+/**
+ * Finds the chunk holding the given offset, which must be within the
+ * buffer. The search starts from the cursor when possible, and the cursor
+ * is left at the chunk found, with _cstart_ set to its offset.
+ */
+struct chunk* buffer_chunk(struct buffer *b, int p) {
+    if (b->cursor == NULL || p < b->cstart) {
+        b->cursor = b->head;
+        b->cstart = 0;
+    }
+
+    while (p - b->cstart >= b->cursor->capacity) {
+        b->cstart += b->cursor->capacity;
+        b->cursor = b->cursor->next;
+    }
+    return b->cursor;
+}
+
 int buffer_append(struct buffer *b, char data[], int n) {
     int m, p;
 
     if (b->head == NULL) {
-        b->tail = new_chunk();
+        b->tail = new_chunk(b);
         if (b->tail == NULL)
             return FALSE;
         b->head = b->tail;
     }
 
     p = 0;
-    m = BUFFER_SIZE - b->tsize;
+    m = b->tail->capacity - b->tsize;
     while (n - p > m) {
         memcpy(b->tail->data + b->tsize, data + p, m);
         p += m;
+        b->size += m;
+        b->tsize += m;
 
-        m = BUFFER_SIZE;
-        b->tail->next = new_chunk();
+        b->tail->next = new_chunk(b);
         if (b->tail->next == NULL)
             return FALSE;
 
         b->tail = b->tail->next;
         b->tsize = 0;
+        m = b->tail->capacity;
     }
 
     memcpy(b->tail->data + b->tsize, data + p, n - p);
     b->tsize += n - p;
-    b->size += n;
+    b->size += n - p;
     return TRUE;
 }
 
 int buffer_append_char(struct buffer *b, char c) {
     if (b->head == NULL) {
-        b->tail = new_chunk();
+        b->tail = new_chunk(b);
         if (b->tail == NULL)
             return FALSE;
         b->head = b->tail;
-    } else if (BUFFER_SIZE - b->tsize == 0) {
-        b->tail->next = new_chunk();
+    } else if (b->tail->capacity - b->tsize == 0) {
+        b->tail->next = new_chunk(b);
         if (b->tail->next == NULL)
             return FALSE;
         b->tail = b->tail->next;
@@ -94,112 +175,64 @@ int buffer_append_char(struct buffer *b, char c) {
 
 char buffer_get(struct buffer *b, int index) {
     struct chunk *c;
-    int i, n;
 
     if (index >= b->size)
         return -1;
 
-    c = b->head;
-    n = index / BUFFER_SIZE;
-    for (i = 0; i < n; i ++)
-        c = c->next;
-    return c->data[index % BUFFER_SIZE];
+    c = buffer_chunk(b, index);
+    return c->data[index - b->cstart];
 }
 
-int buffer_starts_with(struct buffer *b, int p, const char data[], int n) {
+char* buffer_span(struct buffer *b, int p, int *n) {
     struct chunk *c;
-    int i, k, k0, k1, m;
-
-    if (b->size - p < n)
-        return FALSE;
-
-    if (n == 0)
-        return TRUE;
-
-    k0 = p / BUFFER_SIZE;
-    k1 = (p + n) / BUFFER_SIZE;
+    int k;
 
-    // skip offset
-
-    c = b->head;
-    for (i = 0; i < k0; i++)
-        c = c->next;
-
-    if (k0 == k1) {
-        // everything is in a single chunk
-        k = p % BUFFER_SIZE;
-        return (memcmp(c->data + k, data, n) == 0);
+    if (p >= b->size) {
+        *n = 0;
+        return NULL;
     }
 
-    // compare end of first chunk
+    c = buffer_chunk(b, p);
+    k = p - b->cstart;
+    *n = min(c->capacity - k, b->size - p);
+    return c->data + k;
+}
 
-    k = p % BUFFER_SIZE;
-    if (memcmp(c->data + k, data, BUFFER_SIZE - k) != 0)
-        return FALSE;
-    c = c->next;
+int buffer_starts_with(struct buffer *b, int p, const char data[], int n) {
+    char *s;
+    int k, m;
 
-    // intermediate chunks
+    if (b->size - p < n)
+        return FALSE;
 
-    for (m = k; n - m > BUFFER_SIZE; m += BUFFER_SIZE) {
-        if (memcmp(c->data, data + m, BUFFER_SIZE) != 0)
+    for (m = 0; m < n; m += k) {
+        s = buffer_span(b, p + m, &k);
+        k = min(k, n - m);
+        if (memcmp(s, data + m, k) != 0)
             return FALSE;
-        c = c->next;
     }
-
-    // start of last chunk
-
-    return (memcmp(c->data, data + m, n - m) == 0);
+    return TRUE;
 }
 
 int buffer_istarts_with(struct buffer *b, int p, const char data[], int n) {
-    struct chunk *c;
-    int i, k, k0, k1, m;
+    char *s;
+    int k, m;
 
     if (b->size - p < n)
         return FALSE;
 
-    if (n == 0)
-        return TRUE;
-
-    k0 = p / BUFFER_SIZE;
-    k1 = (p + n) / BUFFER_SIZE;
-
-    // skip offset
-
-    c = b->head;
-    for (i = 0; i < k0; i++)
-        c = c->next;
-
-    if (k0 == k1) {
-        // everything is in a single chunk
-        k = p % BUFFER_SIZE;
-        return (strncasecmp(c->data + k, data, n) == 0);
-    }
-
-    // compare end of first chunk
-
-    k = p % BUFFER_SIZE;
-    if (strncasecmp(c->data + k, data, BUFFER_SIZE - k) != 0)
-        return FALSE;
-    c = c->next;
-
-    // intermediate chunks
-
-    for (m = k; n - m > BUFFER_SIZE; m += BUFFER_SIZE) {
-        if (strncasecmp(c->data, data + m, BUFFER_SIZE) != 0)
+    for (m = 0; m < n; m += k) {
+        s = buffer_span(b, p + m, &k);
+        k = min(k, n - m);
+        if (strncasecmp(s, data + m, k) != 0)
             return FALSE;
-        c = c->next;
     }
-
-    // start of last chunk
-
-    return (strncasecmp(c->data, data + m, n - m) == 0);
+    return TRUE;
 }
 
 char* buffer_copy(struct buffer *b, int p, int n) {
-    struct chunk *c;
-    int i, k, k0, k1, m;
-    char* data;
+    char *data, *s;
+    int k, m;
 
     if (b->size - p < n)
         return NULL;
@@ -208,42 +241,13 @@ char* buffer_copy(struct buffer *b, int p, int n) {
     if (data == NULL)
         return NULL;
 
-    data[n] = '\0';
-    if (n == 0)
-        return data;
-
-    k0 = p / BUFFER_SIZE;
-    k1 = (p + n) / BUFFER_SIZE;
-
-    // skip offset
-
-    c = b->head;
-    for (i = 0; i < k0; i++)
-        c = c->next;
-
-    if (k0 == k1) {
-        // everything is in a single chunk
-        k = p % BUFFER_SIZE;
-        memcpy(data, c->data + k, n);
-        return data;
-    }
-
-    // copy end of first chunk
-
-    k = p % BUFFER_SIZE;
-    memcpy(data, c->data + k, BUFFER_SIZE - k);
-    c = c->next;
-
-    // intermediate chunks
-
-    for (m = k; n - m > BUFFER_SIZE; m += BUFFER_SIZE) {
-        memcpy(data + m, c->data, BUFFER_SIZE);
-        c = c->next;
+    for (m = 0; m < n; m += k) {
+        s = buffer_span(b, p + m, &k);
+        k = min(k, n - m);
+        memcpy(data + m, s, k);
     }
 
-    // start of last chunk
-
-    memcpy(data + m, c->data, n - m);
+    data[n] = '\0';
     return data;
 }
 
@@ -256,76 +260,110 @@ int buffer_shift(struct buffer *b) {
 
     if (b->head == b->tail) {
         r = b->size;
-        free(b->head);
+        free_chunk(b, b->head);
         b->head = NULL;
         b->tail = NULL;
+        b->cursor = NULL;
+        b->cstart = 0;
         b->size = 0;
         b->tsize = 0;
     } else {
-        r = BUFFER_SIZE;
         c = b->head;
+        r = c->capacity;
         b->head = c->next;
-        b->size -= BUFFER_SIZE;
-        free(c);
+        b->size -= r;
+        if (b->cursor == c)
+            b->cursor = NULL;
+        else
+            b->cstart -= r;
+        free_chunk(b, c);
     }
     return r;
 }
 
-int buffer_write(struct buffer *b, int p, int fd) {
-    struct chunk *c;
-    int i, k, k0, k1, m, r;
-    char* data;
-
-    errno = 0;
-    if (b->size - p  == 0)
-        return TRUE;
+int buffer_discard(struct buffer *b, int n) {
+    int r;
 
-    k0 = p / BUFFER_SIZE;
-    k1 = (p + b->size) / BUFFER_SIZE;
+    for (r = 0; b->head != NULL && n - r >= b->head->capacity;)
+        r += buffer_shift(b);
+    return r;
+}
 
-    // skip offset
+void buffer_truncate(struct buffer *b, int n) {
+    struct chunk *c, *next;
 
-    c = b->head;
-    for (i = 0; i < k0; i++)
-        c = c->next;
+    if (n >= b->size)
+        return;
 
-    if (k0 == k1) {
-        // everything is in a single chunk
-        r = write(fd, c->data + p % BUFFER_SIZE, b->size);
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            errno = 0;
-        return r;
+    if (n == 0) {
+        clear_buffer(b);
+        return;
     }
 
-    // copy end of first chunk
+    c = buffer_chunk(b, n - 1);
+    next = c->next;
+    c->next = NULL;
 
-    k = p % BUFFER_SIZE;
-    r = write(fd, c->data + k, BUFFER_SIZE - k);
-    if (errno != 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            errno = 0;
-        return r;
-    }
-    c = c->next;
+    b->tail = c;
+    b->tsize = n - b->cstart;
+    b->size = n;
 
-    // intermediate chunks
+    while (next != NULL) {
+        c = next;
+        next = c->next;
+        free_chunk(b, c);
+    }
+}
 
-    for (m = k; b->size - m > BUFFER_SIZE; m += BUFFER_SIZE) {
-        r = write(fd, c->data, BUFFER_SIZE);
-        if (errno != 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                errno = 0;
-            return r;
+void buffer_erase(struct buffer *b, int p, int n) {
+    struct chunk *dst, *src;
+    int i, j, k, m;
+
+    if (n <= 0)
+        return;
+
+    // move down the data after the erased bytes, if any
+
+    m = b->size - p - n;
+    if (m > 0) {
+        dst = buffer_chunk(b, p);
+        i = p - b->cstart;
+        src = buffer_chunk(b, p + n);
+        j = p + n - b->cstart;
+
+        for (; m > 0; m -= k) {
+            k = min(m, min(dst->capacity - i, src->capacity - j));
+            memmove(dst->data + i, src->data + j, k);
+
+            i += k;
+            if (i == dst->capacity) {
+                dst = dst->next;
+                i = 0;
+            }
+
+            j += k;
+            if (j == src->capacity) {
+                src = src->next;
+                j = 0;
+            }
         }
-        c = c->next;
     }
 
-    // start of last chunk
+    buffer_truncate(b, b->size - n);
+}
 
-    r = write(fd, c->data, b->size - m);
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-        errno = 0;
-    return r;
+int buffer_gather(struct buffer *b, int p, struct iovec iov[], int n) {
+    int i, m;
+
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = buffer_span(b, p, &m);
+        if (iov[i].iov_base == NULL)
+            break;
+
+        iov[i].iov_len = m;
+        p += m;
+    }
+    return i;
 }
 
 #ifdef DEBUG
@@ -336,7 +374,7 @@ void buffer_debug(struct buffer *b) {
 
     printf("size=%d,data=[", b->size);
     for (p = b->head; p != NULL; p = p->next) {
-        n = (p->next == NULL) ? b->tsize : BUFFER_SIZE;
+        n = (p->next == NULL) ? b->tsize : p->capacity;
         for (i = 0; i < n; i++) {
             c = p->data[i];
             if (!isprint(c)) {
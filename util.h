@@ -8,28 +8,47 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/uio.h>
 
+#include "arena.h"
 #include "config.h"
 
 
 // data types
 
+/**
+ * Buffer chunk. Pooled chunks hold BUFFER_SIZE bytes, but a buffer may
+ * also own a smaller inline chunk, stored by whoever owns the buffer.
+ */
+struct chunk {
+    struct chunk* next;
+    char* data;
+    int capacity;
+};
+
+/**
+ * Chunked byte buffer. The cursor remembers the last chunk accessed (and
+ * the offset it starts at), so sequential access takes constant time.
+ * Small contents fit in the inline chunk (if any), which is always used
+ * first, so they need no chunk from the pool.
+ */
 struct buffer {
     struct chunk* head;
     struct chunk* tail;
+    struct chunk* cursor;
+    int cstart;
     int size;
     int tsize;
+    struct chunk own;
 };
 
-struct chunk {
-    struct chunk* next;
-    char data[BUFFER_SIZE];
-};
-
-struct {
+struct chunk_pool {
     struct chunk *pool;
     int size;
-} chunk_pool;
+};
+
+// each worker thread keeps its own pool of chunks, preallocated
+extern __thread struct chunk_pool chunk_pool;
 
 
 // macros
@@ -48,15 +67,31 @@ struct {
 
 #endif
 
+// arena space taken by a pooled chunk
+#define CHUNK_SIZE (CACHE_LINE_SIZE + BUFFER_SIZE)
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
 
 // functions
 
+/**
+ * Fills the chunk pool of the current thread with the given number of
+ * chunks from an arena. Returns FALSE if the arena is too small.
+ */
+int init_chunk_pool(struct arena*, int);
+
 /**
  * Initializes an empty buffer.
  */
 void init_buffer(struct buffer*);
 
+/**
+ * Gives the buffer inline storage of some size, used before any pooled
+ * chunk. Must be called while the buffer is empty.
+ */
+void buffer_set_inline(struct buffer*, char[], int);
+
 /**
  * Clears the contents of the buffer, releasing all chunks.
  */
@@ -68,6 +103,14 @@ int buffer_append_char(struct buffer*, char);
 
 char buffer_get(struct buffer*, int);
 
+/**
+ * Gets the contiguous data starting at the given offset, up to the end of
+ * its chunk or of the buffer, setting its length in the last argument.
+ * Returns NULL at the end of the buffer. Use it to iterate the buffer one
+ * span at a time.
+ */
+char* buffer_span(struct buffer*, int, int*);
+
 /**
  * Checks that the buffer (offset by some bytes) contains the given
  * prefix (of some length), case sensitively.
@@ -89,7 +132,29 @@ char* buffer_copy(struct buffer*, int, int);
 
 int buffer_shift(struct buffer*);
 
-int buffer_write(struct buffer*, int, int);
+/**
+ * Drops the leading chunks that only hold data before the given offset.
+ * Returns the number of bytes dropped, by which offsets into the buffer
+ * must be moved down.
+ */
+int buffer_discard(struct buffer*, int);
+
+/**
+ * Shortens the buffer to the given size, releasing the chunks left empty.
+ */
+void buffer_truncate(struct buffer*, int);
+
+/**
+ * Removes some bytes (second argument) from the buffer at the given
+ * offset (first argument), moving down the data after them.
+ */
+void buffer_erase(struct buffer*, int, int);
+
+/**
+ * Fills an array of iovec (of some length) with the buffer data from the
+ * given offset, one entry per chunk. Returns the number of entries used.
+ */
+int buffer_gather(struct buffer*, int, struct iovec[], int);
 
 #ifdef DEBUG
 void buffer_debug(struct buffer*);